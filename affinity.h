@@ -0,0 +1,27 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_AFFINITY_H
+#define _EXP_PERF_AFFINITY_H
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <system_error>
+
+namespace exp_perf
+{
+// Pin the calling thread to a single cpu
+inline void
+pin_self(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        throw std::system_error(err, std::system_category());
+    }
+}
+}
+
+#endif  // _EXP_PERF_AFFINITY_H
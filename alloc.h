@@ -0,0 +1,168 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_ALLOC_H
+#define _EXP_PERF_ALLOC_H
+
+#include <stdlib.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace exp_perf
+{
+//
+// Allocation accounting for the pseudo events event::alloc_calls() and
+// event::alloc_bytes().
+//
+// The counts are per thread and plain thread_local integers, so counting an
+// allocation takes no lock and no atomic. Nothing is counted unless one
+// translation unit of the executable installs a hook:
+//
+//   EXP_PERF_COUNT_NEW()     replaces the global operator new and delete
+//   EXP_PERF_COUNT_MALLOC()  interposes malloc, calloc and realloc, which
+//                            also covers operator new as libstdc++ implements
+//                            it on malloc. glibc only.
+//
+// Use one of them, not both, or operator new is counted twice. Put it in the
+// executable rather than a shared library, where the first access to a
+// thread_local can itself allocate. posix_memalign(), aligned_alloc() and
+// memory the kernel hands out, mmap() for example, are not counted.
+//
+// For example, to also report allocations per input size:
+//
+// EXP_PERF_COUNT_NEW();
+// ...
+// collector c(0.05, 0.01, 10, 1000, 20, 50,
+//             {event::hw(PERF_COUNT_HW_INSTRUCTIONS),
+//              event::alloc_calls(),
+//              event::alloc_bytes()},
+//             {event::hw(PERF_COUNT_HW_INSTRUCTIONS)});
+// c.set_tracking(collector::TRACK_ALL);
+//
+struct alloc_counts {
+    uint64_t calls;
+    uint64_t bytes;
+};
+
+class allocations
+{
+  public:
+    // The running totals of the calling thread
+    static alloc_counts get();
+
+    // Count one allocation of bytes on the calling thread, called by the
+    // hooks
+    static void count(size_t bytes);
+
+    // Whether a hook is installed, set by the hook macros before main()
+    static bool& hooked();
+
+  private:
+    static alloc_counts& local();
+};
+
+inline alloc_counts&
+allocations::local()
+{
+    // Zero initialized, so no guard or TLS constructor runs on access
+    static thread_local alloc_counts counts;
+    return counts;
+}
+
+inline alloc_counts
+allocations::get()
+{
+    return local();
+}
+
+inline void
+allocations::count(size_t bytes)
+{
+    alloc_counts& c = local();
+    ++c.calls;
+    c.bytes += bytes;
+}
+
+inline bool&
+allocations::hooked()
+{
+    static bool h = false;
+    return h;
+}
+}
+
+// Replace the global operator new and delete with counting ones, in exactly
+// one translation unit
+#define EXP_PERF_COUNT_NEW()                                                  \
+    static void* exp_perf_counted_new(size_t n)                              \
+    {                                                                        \
+        ::exp_perf::allocations::count(n);                                   \
+        void* p = malloc(n != 0 ? n : 1);                                    \
+        if (p == nullptr) {                                                  \
+            throw std::bad_alloc();                                          \
+        }                                                                    \
+        return p;                                                            \
+    }                                                                        \
+    void* operator new(size_t n)                                             \
+    {                                                                        \
+        return exp_perf_counted_new(n);                                      \
+    }                                                                        \
+    void* operator new[](size_t n)                                           \
+    {                                                                        \
+        return exp_perf_counted_new(n);                                      \
+    }                                                                        \
+    void* operator new(size_t n, const std::nothrow_t&) noexcept             \
+    {                                                                        \
+        ::exp_perf::allocations::count(n);                                   \
+        return malloc(n != 0 ? n : 1);                                       \
+    }                                                                        \
+    void* operator new[](size_t n, const std::nothrow_t&) noexcept           \
+    {                                                                        \
+        ::exp_perf::allocations::count(n);                                   \
+        return malloc(n != 0 ? n : 1);                                       \
+    }                                                                        \
+    void operator delete(void* p) noexcept                                   \
+    {                                                                        \
+        free(p);                                                             \
+    }                                                                        \
+    void operator delete[](void* p) noexcept                                 \
+    {                                                                        \
+        free(p);                                                             \
+    }                                                                        \
+    void operator delete(void* p, size_t) noexcept                           \
+    {                                                                        \
+        free(p);                                                             \
+    }                                                                        \
+    void operator delete[](void* p, size_t) noexcept                         \
+    {                                                                        \
+        free(p);                                                             \
+    }                                                                        \
+    static const bool exp_perf_new_hooked __attribute__((unused)) =          \
+        (::exp_perf::allocations::hooked() = true)
+
+// Interpose malloc, calloc and realloc with counting ones that forward to
+// glibc's, in exactly one translation unit of the executable
+#define EXP_PERF_COUNT_MALLOC()                                               \
+    extern "C" void* __libc_malloc(size_t);                                  \
+    extern "C" void* __libc_calloc(size_t, size_t);                          \
+    extern "C" void* __libc_realloc(void*, size_t);                          \
+    extern "C" void* malloc(size_t n)                                        \
+    {                                                                        \
+        ::exp_perf::allocations::count(n);                                   \
+        return __libc_malloc(n);                                             \
+    }                                                                        \
+    extern "C" void* calloc(size_t k, size_t n)                              \
+    {                                                                        \
+        ::exp_perf::allocations::count(k * n);                               \
+        return __libc_calloc(k, n);                                          \
+    }                                                                        \
+    extern "C" void* realloc(void* p, size_t n)                              \
+    {                                                                        \
+        ::exp_perf::allocations::count(n);                                   \
+        return __libc_realloc(p, n);                                         \
+    }                                                                        \
+    static const bool exp_perf_malloc_hooked __attribute__((unused)) =       \
+        (::exp_perf::allocations::hooked() = true)
+
+#endif  // _EXP_PERF_ALLOC_H
@@ -0,0 +1,195 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_BASELINE_CACHE_H
+#define _EXP_PERF_BASELINE_CACHE_H
+
+#include "event.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <tuple>
+
+namespace exp_perf
+{
+//
+// Results of earlier runs, kept on disk so that unchanged benchmarks don't
+// have to be measured from scratch, see collector::set_cache().
+//
+// Entries are keyed by the benchmark name, a content hash the user computes
+// over whatever defines the benchmark (its source, the compiler flags, ...),
+// the input size and the event minimized. A new hash never matches an old
+// entry, so changed code is always measured again.
+//
+// The file is plain text, one entry per line. Nothing is written until
+// save(). Collectors sweeping over several CPUs may share one cache.
+//
+class baseline_cache
+{
+  public:
+    struct entry {
+        double sum;
+        long long L_hat;
+        double lam_hat;
+        int n_tot;
+        int batch;
+    };
+
+    // Loads path if it exists, it is created by save() otherwise
+    explicit baseline_cache(std::string path);
+
+    // Look up an entry, returns false if there is none
+    bool find(const std::string& name,
+              uint64_t hash,
+              int input_sz,
+              const event& target,
+              entry& e) const;
+
+    // Add or replace an entry. name may not contain tabs or newlines.
+    void store(const std::string& name,
+               uint64_t hash,
+               int input_sz,
+               const event& target,
+               const entry& e);
+
+    // Write all entries back to path
+    void save() const;
+
+    // FNV-1a, for building a content hash
+    static uint64_t hash(const void* data, size_t len, uint64_t h = 0);
+
+  private:
+    using key = std::tuple<std::string, uint64_t, int, uint32_t, uint64_t>;
+
+    const std::string m_path;
+    mutable std::mutex m_mtx;
+    std::map<key, entry> m_entries;
+};
+
+inline baseline_cache::baseline_cache(std::string path)
+    : m_path(std::move(path))
+{
+    FILE* f = fopen(m_path.c_str(), "r");
+    if (f == nullptr) {
+        if (errno == ENOENT) {
+            return;
+        }
+        throw std::system_error(errno, std::system_category());
+    }
+    char* line = nullptr;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) > 0) {
+        // name \t hash input_sz type config sum L_hat lam_hat n_tot batch
+        const char* tab = strchr(line, '\t');
+        if (tab == nullptr) {
+            continue;
+        }
+        uint64_t h, config;
+        int input_sz;
+        uint32_t type;
+        entry e;
+        if (sscanf(tab + 1,
+                   "%" SCNx64 " %d %" SCNu32 " %" SCNx64 " %lf %lld %lf %d %d",
+                   &h,
+                   &input_sz,
+                   &type,
+                   &config,
+                   &e.sum,
+                   &e.L_hat,
+                   &e.lam_hat,
+                   &e.n_tot,
+                   &e.batch) == 9) {
+            const std::string name(line, tab - line);
+            m_entries[key(name, h, input_sz, type, config)] = e;
+        }
+    }
+    free(line);
+    fclose(f);
+}
+
+inline bool
+baseline_cache::find(const std::string& name,
+                     uint64_t hash,
+                     int input_sz,
+                     const event& target,
+                     entry& e) const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    const auto it =
+        m_entries.find(key(name, hash, input_sz, target.type, target.config));
+    if (it == m_entries.end()) {
+        return false;
+    }
+    e = it->second;
+    return true;
+}
+
+inline void
+baseline_cache::store(const std::string& name,
+                      uint64_t hash,
+                      int input_sz,
+                      const event& target,
+                      const entry& e)
+{
+    if (name.find_first_of("\t\n") != std::string::npos) {
+        throw std::system_error(EINVAL, std::system_category());
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_entries[key(name, hash, input_sz, target.type, target.config)] = e;
+}
+
+inline void
+baseline_cache::save() const
+{
+    // Write a copy and rename it, so that a crash never leaves half a cache
+    const std::string tmp = m_path + ".tmp";
+    FILE* f               = fopen(tmp.c_str(), "w");
+    if (f == nullptr) {
+        throw std::system_error(errno, std::system_category());
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        for (const auto& x : m_entries) {
+            const key& k   = x.first;
+            const entry& e = x.second;
+            fprintf(f,
+                    "%s\t%" PRIx64 " %d %" PRIu32 " %" PRIx64
+                    " %.17g %lld %.17g %d %d\n",
+                    std::get<0>(k).c_str(),
+                    std::get<1>(k),
+                    std::get<2>(k),
+                    std::get<3>(k),
+                    std::get<4>(k),
+                    e.sum,
+                    e.L_hat,
+                    e.lam_hat,
+                    e.n_tot,
+                    e.batch);
+        }
+    }
+    if (fclose(f) != 0 || rename(tmp.c_str(), m_path.c_str()) != 0) {
+        throw std::system_error(errno, std::system_category());
+    }
+}
+
+inline uint64_t
+baseline_cache::hash(const void* data, size_t len, uint64_t h)
+{
+    if (h == 0) {
+        h = 14695981039346656037ULL;
+    }
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+}
+
+#endif  // _EXP_PERF_BASELINE_CACHE_H
@@ -0,0 +1,707 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_BASIC_COLLECTOR_H
+#define _EXP_PERF_BASIC_COLLECTOR_H
+
+#include "counter.h"
+#include "event.h"
+#include "schedule.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <ratio>
+#include <system_error>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// The collection algorithm of collector with everything chosen at compile
+// time.
+//
+// collector decides what to measure, when to stop and which input sizes to
+// visit at runtime, and its sampling loop branches on all of its options.
+// basic_collector takes them as policies instead, so the loop is nothing but
+// the backend's start() and stop() around run() and the rule's add(), and
+// the rule is inlined with its parameters, and -log(alpha), as constants.
+// It has none of
+// collector's extras: no batching, warm-up, rejection, tracking, logging or
+// caching.
+//
+// For example, the TSC, alpha = 0.01 and beta_min = 0.005, over 10 doublings
+// from 1024:
+//
+// using rule = exponential_rule<std::ratio<1, 100>, std::ratio<5, 1000>>;
+// basic_collector<tsc_backend, rule, doubling_schedule<1024, 10>> c;
+// c.collect(start, stop, run, u);
+//
+// where u is an updater as for collector::collect().
+//
+
+//
+// Backends. Each has
+//
+//   start()       - right before the window
+//   stop()        - right after it, returns the count of the window
+//   get_target()  - the event it measures
+//
+// and throws ENOENT from its constructor if it can't measure here, and
+// EAGAIN from stop() if the window wasn't measured at all.
+//
+
+// One perf event, read with rdpmc where the kernel allows it
+template <uint32_t t_type, uint64_t t_config>
+class perf_backend
+{
+  public:
+    perf_backend();
+
+    void start();
+    long long stop();
+
+    static event get_target();
+
+  private:
+    fixed_counter<1> m_counter;
+};
+
+// One of the timers of timer.h
+template <typename t_timer>
+class timer_backend
+{
+  public:
+    timer_backend();
+
+    void start();
+    long long stop();
+
+    static event get_target();
+
+  private:
+    long long m_begin;
+};
+
+using instructions_backend =
+    perf_backend<PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS>;
+using cycles_backend =
+    perf_backend<PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES>;
+using task_clock_backend =
+    perf_backend<PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK>;
+using tsc_backend   = timer_backend<tsc_timer>;
+using clock_backend = timer_backend<clock_timer>;
+
+//
+// Stopping rules. A rule is built for every input size, is fed the samples
+// and decides how many to take, with
+//
+//   add(x)        - one sample
+//   get_next_n()  - how many samples to add before the next update(), first
+//                   called before any are
+//   update()      - apply the rule, returns true when the input size is done
+//   get_sum(), get_L_hat(), get_n_tot()
+//                 - what the updater receives
+//
+// so a rule replaces the algorithm, not just its parameters.
+//
+
+namespace basic_collector_detail
+{
+constexpr double ln2 = 0.693147180559945309417;
+
+// 2 atanh(y) = log((1 + y) / (1 - y)) from its power series, term = y^(2k+1)
+constexpr double
+log_series(double y2, double term, int k)
+{
+    return k > 30 ? 0 : term / (2 * k + 1) + log_series(y2, term * y2, k + 1);
+}
+
+// log(x) for x > 0, which std::log isn't constexpr for. x is first brought
+// into [0.5, 1), where the series converges fast.
+constexpr double
+log(double x)
+{
+    return x < 0.5  ? log(2 * x) - ln2
+           : x >= 1 ? log(x / 2) + ln2
+                    : 2 * log_series(((x - 1) / (x + 1)) * ((x - 1) / (x + 1)),
+                                     (x - 1) / (x + 1),
+                                     0);
+}
+}
+
+//
+// The stopping rule of estimator, see collector::collector() for the
+// meaning of the parameters. alpha and beta_min are std::ratio, since a
+// double can't be a template parameter, and -log(alpha) is computed at
+// compile time.
+//
+template <typename t_alpha      = std::ratio<5, 100>,
+          typename t_beta_min   = std::ratio<1, 100>,
+          int t_min_incr        = 10,
+          int t_max_incr        = 1000,
+          int t_max_rounds      = 20,
+          int t_n_init          = 50>
+class exponential_rule
+{
+  public:
+    static constexpr double alpha    = (double)t_alpha::num / t_alpha::den;
+    static constexpr double beta_min =
+        (double)t_beta_min::num / t_beta_min::den;
+    static constexpr int min_incr   = t_min_incr;
+    static constexpr int max_incr   = t_max_incr;
+    static constexpr int max_rounds = t_max_rounds;
+    static constexpr int n_init     = t_n_init;
+
+    static constexpr double neg_log_alpha = -basic_collector_detail::log(alpha);
+
+    static_assert(t_alpha::num > 0 && t_alpha::num < t_alpha::den,
+                  "alpha must be in (0, 1)");
+    static_assert(t_beta_min::num > 0, "beta_min must be positive");
+    static_assert(0 < t_min_incr && t_min_incr <= t_max_incr,
+                  "need 0 < min_incr <= max_incr");
+    static_assert(t_max_rounds > 0 && t_n_init > 0,
+                  "need max_rounds > 0 and n_init > 0");
+
+    exponential_rule();
+
+    void add(long long x);
+    int get_next_n() const;
+
+    // estimator::update(), which also gives up after max_rounds
+    bool update();
+
+    double get_sum() const;
+    long long get_L_hat() const;
+    int get_n_tot() const;
+
+  private:
+    double m_sum;
+    long long m_min;
+    int m_n_tot;
+    int m_next_n;
+    int m_rounds;
+};
+
+// Exactly t_n samples, for example to compare with a fixed sample count
+template <int t_n>
+class fixed_rule
+{
+  public:
+    static_assert(t_n > 0, "need n > 0");
+
+    fixed_rule();
+
+    void add(long long x);
+    int get_next_n() const;
+    bool update();
+
+    double get_sum() const;
+    long long get_L_hat() const;
+    int get_n_tot() const;
+
+  private:
+    double m_sum;
+    long long m_min;
+    int m_n_tot;
+};
+
+//
+// Schedules, each with a static sizes() returning the input sizes to visit
+// in order
+//
+
+// init, 2 init, ... runs sizes, as collector::collect()
+template <int t_init, int t_runs>
+struct doubling_schedule {
+    static_assert(t_init > 0 && t_runs > 0, "need init > 0 and runs > 0");
+    static std::vector<int> sizes();
+};
+
+// cache_schedule() of this CPU
+template <int t_min,
+          int t_max,
+          int t_bytes_per_element,
+          int t_per_transition = 4>
+struct cache_aware_schedule {
+    static std::vector<int> sizes();
+};
+
+template <typename t_backend,
+          typename t_rule     = exponential_rule<>,
+          typename t_schedule = doubling_schedule<1024, 8>>
+class basic_collector
+{
+  public:
+    using backend_t  = t_backend;
+    using rule_t     = t_rule;
+    using schedule_t = t_schedule;
+
+    // Throws if the backend can't measure here
+    basic_collector();
+
+    // Visit every input size of the schedule, see collector::collect()
+    template <typename t_start,
+              typename t_stop,
+              typename t_run,
+              typename t_updater>
+    void collect(t_start start, t_stop stop, t_run run, t_updater u);
+
+    event get_target() const;
+
+  private:
+    template <typename t_start,
+              typename t_stop,
+              typename t_run,
+              typename t_updater>
+    void collect_for_input_size(int input_sz,
+                                t_start start,
+                                t_stop stop,
+                                t_run run,
+                                t_updater u);
+
+    t_backend m_backend;
+};
+
+template <uint32_t t_type, uint64_t t_config>
+perf_backend<t_type, t_config>::perf_backend()
+    : m_counter({get_target()}, fixed_counter<1>::READ_RDPMC)
+{
+    if (m_counter.get_counts_size() == 0) {
+        throw std::system_error(ENOENT, std::system_category());
+    }
+}
+
+template <uint32_t t_type, uint64_t t_config>
+void
+perf_backend<t_type, t_config>::start()
+{
+    m_counter.start();
+}
+
+template <uint32_t t_type, uint64_t t_config>
+long long
+perf_backend<t_type, t_config>::stop()
+{
+    m_counter.stop();
+    if (m_counter.is_unscheduled()) {
+        // A count of 0 would pass for a new minimum
+        throw std::system_error(EAGAIN, std::system_category());
+    }
+    return m_counter.get_counts()[0];
+}
+
+template <uint32_t t_type, uint64_t t_config>
+event
+perf_backend<t_type, t_config>::get_target()
+{
+    // sw() knows which software events only count in the kernel
+    return t_type == PERF_TYPE_SOFTWARE ? event::sw(t_config)
+                                        : event{t_type, t_config, 0, false};
+}
+
+template <typename t_timer>
+timer_backend<t_timer>::timer_backend()
+    : m_begin(0)
+{
+    if (!t_timer::available()) {
+        throw std::system_error(ENOENT, std::system_category());
+    }
+}
+
+template <typename t_timer>
+void
+timer_backend<t_timer>::start()
+{
+    m_begin = t_timer::begin();
+}
+
+template <typename t_timer>
+long long
+timer_backend<t_timer>::stop()
+{
+    return t_timer::end() - m_begin;
+}
+
+template <>
+inline event
+timer_backend<tsc_timer>::get_target()
+{
+    return event::tsc();
+}
+
+template <>
+inline event
+timer_backend<clock_timer>::get_target()
+{
+    return event::clock();
+}
+
+// Definitions, for when the constants are bound to a reference
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+constexpr double exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::alpha;
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+constexpr double exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::beta_min;
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+constexpr double exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::neg_log_alpha;
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+constexpr int exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::min_incr;
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+constexpr int exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::max_incr;
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+constexpr int exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::max_rounds;
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+constexpr int exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::n_init;
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::exponential_rule()
+    : m_sum(0)
+    , m_min(0)
+    , m_n_tot(0)
+    , m_next_n(n_init)
+    , m_rounds(0)
+{
+}
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+void
+exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::add(long long x)
+{
+    m_sum += x;
+    if (m_n_tot == 0 || x < m_min) {
+        m_min = x;
+    }
+    ++m_n_tot;
+}
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+int
+exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::get_next_n() const
+{
+    return m_next_n;
+}
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+bool
+exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::update()
+{
+    if (++m_rounds >= max_rounds) {
+        return true;
+    }
+    if (m_n_tot == 0) {
+        return false;
+    }
+    const double L_hat = (double)m_min;
+    const double xbar  = m_sum / m_n_tot;
+    if (xbar <= L_hat) {
+        // Every sample was the minimum, there is nothing left to learn
+        return true;
+    }
+    if (L_hat <= 0) {
+        // No relative bound can be met, gather until max_rounds
+        m_next_n = min_incr;
+        return false;
+    }
+    // beta = -log(alpha) / (n_tot lam_hat L_hat), lam_hat = 1 / (xbar - L_hat)
+    const double spread = (xbar - L_hat) / L_hat;
+    if (neg_log_alpha * spread / m_n_tot <= beta_min) {
+        return true;
+    }
+    const int new_n = (int)(neg_log_alpha * spread / beta_min);
+    m_next_n = new_n < m_n_tot
+                   ? min_incr
+                   : std::max(min_incr, std::min(max_incr, new_n - m_n_tot));
+    return false;
+}
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+double
+exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::get_sum() const
+{
+    return m_sum;
+}
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+long long
+exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::get_L_hat() const
+{
+    return m_min;
+}
+
+template <typename t_alpha,
+          typename t_beta_min,
+          int t_min_incr,
+          int t_max_incr,
+          int t_max_rounds,
+          int t_n_init>
+int
+exponential_rule<t_alpha,
+                 t_beta_min,
+                 t_min_incr,
+                 t_max_incr,
+                 t_max_rounds,
+                 t_n_init>::get_n_tot() const
+{
+    return m_n_tot;
+}
+
+template <int t_n>
+fixed_rule<t_n>::fixed_rule()
+    : m_sum(0)
+    , m_min(0)
+    , m_n_tot(0)
+{
+}
+
+template <int t_n>
+void
+fixed_rule<t_n>::add(long long x)
+{
+    m_sum += x;
+    if (m_n_tot == 0 || x < m_min) {
+        m_min = x;
+    }
+    ++m_n_tot;
+}
+
+template <int t_n>
+int
+fixed_rule<t_n>::get_next_n() const
+{
+    return t_n;
+}
+
+template <int t_n>
+bool
+fixed_rule<t_n>::update()
+{
+    return true;
+}
+
+template <int t_n>
+double
+fixed_rule<t_n>::get_sum() const
+{
+    return m_sum;
+}
+
+template <int t_n>
+long long
+fixed_rule<t_n>::get_L_hat() const
+{
+    return m_min;
+}
+
+template <int t_n>
+int
+fixed_rule<t_n>::get_n_tot() const
+{
+    return m_n_tot;
+}
+
+template <int t_init, int t_runs>
+std::vector<int>
+doubling_schedule<t_init, t_runs>::sizes()
+{
+    std::vector<int> s;
+    for (int i = 0, N = t_init; i < t_runs; ++i, N *= 2) {
+        s.push_back(N);
+    }
+    return s;
+}
+
+template <int t_min, int t_max, int t_bytes_per_element, int t_per_transition>
+std::vector<int>
+cache_aware_schedule<t_min, t_max, t_bytes_per_element, t_per_transition>::
+    sizes()
+{
+    return cache_schedule(t_min, t_max, t_bytes_per_element, t_per_transition);
+}
+
+template <typename t_backend, typename t_rule, typename t_schedule>
+basic_collector<t_backend, t_rule, t_schedule>::basic_collector()
+{
+}
+
+template <typename t_backend, typename t_rule, typename t_schedule>
+event
+basic_collector<t_backend, t_rule, t_schedule>::get_target() const
+{
+    return t_backend::get_target();
+}
+
+template <typename t_backend, typename t_rule, typename t_schedule>
+template <typename t_start, typename t_stop, typename t_run, typename t_updater>
+void
+basic_collector<t_backend, t_rule, t_schedule>::collect(t_start start,
+                                                        t_stop stop,
+                                                        t_run run,
+                                                        t_updater u)
+{
+    for (int N : t_schedule::sizes()) {
+        collect_for_input_size(N, start, stop, run, u);
+    }
+}
+
+template <typename t_backend, typename t_rule, typename t_schedule>
+template <typename t_start, typename t_stop, typename t_run, typename t_updater>
+void
+basic_collector<t_backend, t_rule, t_schedule>::collect_for_input_size(
+    int input_sz,
+    t_start start,
+    t_stop stop,
+    t_run run,
+    t_updater u)
+{
+    t_rule r;
+    do {
+        for (int i = 0, n = r.get_next_n(); i < n; ++i) {
+            start(input_sz);
+            m_backend.start();
+            run(input_sz);
+            const long long x = m_backend.stop();
+            stop(input_sz);
+            r.add(x);
+        }
+    } while (!r.update());
+    u(input_sz, r.get_sum(), r.get_L_hat(), r.get_n_tot());
+}
+}
+
+#endif  // _EXP_PERF_BASIC_COLLECTOR_H
@@ -0,0 +1,77 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_BENCHMARK_H
+#define _EXP_PERF_BENCHMARK_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// A benchmark as collector::collect() takes it
+//
+struct benchmark {
+    std::string name;
+    std::function<void(int)> start;
+    std::function<void(int)> stop;
+    std::function<void(int)> run;
+};
+
+//
+// Every benchmark registered with EXP_PERF_BENCHMARK, see runner.h
+//
+class registry
+{
+  public:
+    // In registration order, which within a file is the order of definition
+    static std::vector<benchmark>& get();
+
+    // Returns true, so that it can initialize a static
+    static bool add(std::string name,
+                    std::function<void(int)> start,
+                    std::function<void(int)> stop,
+                    std::function<void(int)> run);
+};
+
+inline std::vector<benchmark>&
+registry::get()
+{
+    // A function local static, so that registering from the static
+    // initializers of any translation unit is safe
+    static std::vector<benchmark> benchmarks;
+    return benchmarks;
+}
+
+inline bool
+registry::add(std::string name,
+              std::function<void(int)> start,
+              std::function<void(int)> stop,
+              std::function<void(int)> run)
+{
+    get().push_back(benchmark{std::move(name),
+                              std::move(start),
+                              std::move(stop),
+                              std::move(run)});
+    return true;
+}
+}
+
+// Register a benchmark with the runner. name must be an identifier, start,
+// stop and run anything callable as f(N), see collector::collect().
+//
+// For example:
+//
+// static std::vector<int> v;
+// EXP_PERF_BENCHMARK(sort_ints,
+//                    [](int N) { v = random_ints(N); },
+//                    [](int) {},
+//                    [](int) { std::sort(v.begin(), v.end()); });
+//
+#define EXP_PERF_BENCHMARK(name, start, stop, run)                            \
+    static const bool exp_perf_benchmark_##name                              \
+        __attribute__((unused)) =                                            \
+            ::exp_perf::registry::add(#name, start, stop, run)
+
+#endif  // _EXP_PERF_BENCHMARK_H
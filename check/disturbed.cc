@@ -0,0 +1,74 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+//
+// Checks that the scheduler events behind collector::set_reject_disturbed()
+// count a context switch and a CPU migration forced inside the window. They
+// only happen in the kernel, so they read 0 if opened user mode only.
+//
+// g++ -std=c++11 -O2 -I.. disturbed.cc -o disturbed && ./disturbed
+//
+// Exits 0 if both counted, 1 if not, and 2 if they can't be opened here, for
+// example because perf_event_paranoid doesn't allow counting in the kernel.
+
+#include "counter.h"
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+using namespace exp_perf;
+
+int
+main()
+{
+    const event switches   = event::sw(PERF_COUNT_SW_CONTEXT_SWITCHES);
+    const event migrations = event::sw(PERF_COUNT_SW_CPU_MIGRATIONS);
+    if (!switches.kernel || !migrations.kernel) {
+        printf("FAIL: scheduler events exclude the kernel\n");
+        return 1;
+    }
+    counter c(std::vector<event>{switches, migrations});
+    const int s = c.find(switches);
+    const int m = c.find(migrations);
+    if (s < 0 || m < 0) {
+        printf("SKIP: can't open the scheduler events\n");
+        return 2;
+    }
+    int failed = 0;
+
+    // Sleeping always gives up the CPU, unlike sched_yield() with nothing
+    // else runnable
+    c.start();
+    sched_yield();
+    usleep(1000);
+    c.stop();
+    printf("context-switches: %lld\n", c.get_counts()[s]);
+    failed += c.get_counts()[s] > 0 ? 0 : 1;
+
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) != 0 ||
+        CPU_COUNT(&mask) < 2) {
+        printf("cpu-migrations: skipped, only one CPU\n");
+    } else {
+        int cpus[2] = {-1, -1};
+        for (int i = 0, k = 0; i < CPU_SETSIZE && k < 2; ++i) {
+            if (CPU_ISSET(i, &mask)) {
+                cpus[k++] = i;
+            }
+        }
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpus[0], &one);
+        sched_setaffinity(0, sizeof(one), &one);
+        c.start();
+        CPU_ZERO(&one);
+        CPU_SET(cpus[1], &one);
+        sched_setaffinity(0, sizeof(one), &one);
+        c.stop();
+        sched_setaffinity(0, sizeof(mask), &mask);
+        printf("cpu-migrations: %lld\n", c.get_counts()[m]);
+        failed += c.get_counts()[m] > 0 ? 0 : 1;
+    }
+    printf("%s\n", failed == 0 ? "OK" : "FAIL");
+    return failed == 0 ? 0 : 1;
+}
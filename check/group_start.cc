@@ -0,0 +1,96 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+//
+// Checks the group start of counter::READ_GROUP against READ_PER_FD.
+//
+// - An empty window counts fewer instructions, or ns of task-clock where
+//   there are no HW counters, when the group is reset and enabled with one
+//   ioctl on its leader than with one ioctl per event.
+// - A sibling counts as much as the same event opened alone, here the page
+//   faults of touching fresh pages.
+//
+// g++ -std=c++11 -O2 -I.. group_start.cc -o group_start && ./group_start
+//
+// Exits 0 if both hold, 1 if not, and 2 if the events can't be opened here.
+
+#include "counter.h"
+#include "overhead.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+using namespace exp_perf;
+
+// The page faults of touching fresh pages, counted by c at index i
+static long long
+touch(counter& c, int i, int pages)
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t size = pages * page;
+    const int prot    = PROT_READ | PROT_WRITE;
+    const int flags   = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* p           = ::mmap(nullptr, size, prot, flags, -1, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    c.start();
+    for (size_t k = 0; k < size; k += page) {
+        static_cast<volatile char*>(p)[k] = 1;
+    }
+    c.stop();
+    ::munmap(p, size);
+    return c.get_counts()[i];
+}
+
+int
+main()
+{
+    const int events  = 4;
+    const int samples = 10000;
+    int failed        = 0;
+
+    overhead per_fd, group;
+    event target   = event::hw(PERF_COUNT_HW_INSTRUCTIONS);
+    const int mode = counter::READ_PER_FD;
+    if (!measure_overhead(target, mode, events, samples, per_fd)) {
+        target = event::sw(PERF_COUNT_SW_TASK_CLOCK);
+        if (!measure_overhead(target, mode, events, samples, per_fd)) {
+            printf("SKIP: can't open instructions or task-clock\n");
+            return 2;
+        }
+    }
+    if (!measure_overhead(
+            target, counter::READ_GROUP, events, samples, group)) {
+        printf("SKIP: can't open %s as a group\n", target.name().c_str());
+        return 2;
+    }
+    printf("empty window, %s of %d events: per-fd %lld, group %lld\n",
+           target.name().c_str(),
+           per_fd.events,
+           per_fd.floor,
+           group.floor);
+    failed += group.floor < per_fd.floor ? 0 : 1;
+
+    const event faults = event::sw(PERF_COUNT_SW_PAGE_FAULTS);
+    const int pages    = 1024;
+    counter alone(std::vector<event>{faults});
+    counter sibling(
+        std::vector<event>{event::sw(PERF_COUNT_SW_TASK_CLOCK), faults});
+    const int a = alone.find(faults);
+    const int s = sibling.find(faults);
+    if (a < 0 || s < 0 || sibling.get_counts_size() < 2) {
+        printf("SKIP: can't open page-faults\n");
+        return 2;
+    }
+    const long long n_alone   = touch(alone, a, pages);
+    const long long n_sibling = touch(sibling, s, pages);
+    printf("page-faults of %d pages: alone %lld, sibling %lld\n",
+           pages,
+           n_alone,
+           n_sibling);
+    failed += n_sibling >= n_alone * 9 / 10 && n_alone > 0 ? 0 : 1;
+
+    printf("%s\n", failed == 0 ? "OK" : "FAIL");
+    return failed == 0 ? 0 : 1;
+}
@@ -3,9 +3,31 @@
 #ifndef _EXP_PERF_COLLECTOR_H
 #define _EXP_PERF_COLLECTOR_H
 
+#include "affinity.h"
+#include "alloc.h"
+#include "baseline_cache.h"
 #include "counter.h"
+#include "estimator.h"
+#include "profile.h"
+#include "regression.h"
+#include "sample_log.h"
+#include "schedule.h"
+#include "timer.h"
+#include "topdown.h"
 
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace exp_perf
 {
@@ -13,8 +35,17 @@ namespace exp_perf
 // A collector that implements the collection and testing algorithm in [Add
 // reference]
 //
-// Defaults to PERF_COUNT_HW_INSTRUCTIONS, but falls back to
-// PERF_COUNT_SW_TASK_CLOCK on systems that don't support HW counters
+// Defaults to PERF_COUNT_HW_INSTRUCTIONS, but falls back to cycles and then to
+// PERF_COUNT_SW_TASK_CLOCK on systems that don't support HW counters, see
+// default_targets(). Any other event can be minimized with the second
+// constructor.
+//
+// HW counters are read with rdpmc where the kernel allows it, see
+// counter::READ_RDPMC, so the window around run() carries almost no
+// measurement overhead.
+//
+// Where no perf event can be opened at all the collector times the window
+// with the TSC or CLOCK_MONOTONIC_RAW instead, see get_backend().
 //
 class collector
 {
@@ -47,12 +78,44 @@ class collector
     // before giving up.
     //
     // n_init - First value of n to estimate.
+    //
+    // inherit - count the threads that run() creates as well, see
+    // counter::counter(). L_hat is then the total work over all threads, and
+    // get_parallelism() compares task-clock with wall-clock.
+    collector(double alpha,
+              double beta_min,
+              int min_incr,
+              int max_incr,
+              int max_rounds,
+              int n_init,
+              bool inherit = false);
+
+    // Constructor for any set of events.
+    //
+    // events - what the counter opens, see counter::counter()
+    //
+    // targets - the event to minimize, in order of preference. The first one
+    // that could be opened is used, and if none could be this throws.
+    //
+    // For example, to minimize LLC misses:
+    //
+    // collector c(0.05, 0.01, 10, 1000, 20, 50,
+    //             {event::hw(PERF_COUNT_HW_INSTRUCTIONS),
+    //              event::cache(PERF_COUNT_HW_CACHE_LL,
+    //                           PERF_COUNT_HW_CACHE_OP_READ,
+    //                           PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    //             {event::cache(PERF_COUNT_HW_CACHE_LL,
+    //                           PERF_COUNT_HW_CACHE_OP_READ,
+    //                           PERF_COUNT_HW_CACHE_RESULT_MISS)});
     collector(double alpha,
               double beta_min,
               int min_incr,
               int max_incr,
               int max_rounds,
-              int n_init);
+              int n_init,
+              std::vector<event> events,
+              std::vector<event> targets,
+              bool inherit = false);
 
     // The main user entry point.
     //
@@ -73,21 +136,476 @@ class collector
                  t_run run,
                  t_updater u);
 
-  private:
-    // We use these to keep track of where the PERF counters are.
+    // Like collect(), over an explicit list of input sizes, for example one
+    // from cache_schedule(). The updater is called in the order of sizes.
+    // set_predict_n() extrapolates from the two sizes before each one,
+    // whatever their ratio.
+    template <typename t_start,
+              typename t_stop,
+              typename t_run,
+              typename t_updater>
+    void collect(const std::vector<int>& sizes,
+                 t_start start,
+                 t_stop stop,
+                 t_run run,
+                 t_updater u);
+
+    // Like collect(), for benchmarks whose input is expensive to build.
+    //
+    // setup - run once per input size before its first sample, not timed
+    // reset - run before every sample, not timed, for example to restore the
+    //   input run() modified
+    // teardown - run once per input size after its last sample, not timed,
+    //   also when collecting it throws
+    //
+    // What is measured between reset and the end of run() is the same as
+    // with collect(), only setup and teardown are no longer paid per sample.
+    // In a sweep, see set_sweep_cpus(), each worker calls setup and teardown
+    // for the input sizes it takes.
+    template <typename t_setup,
+              typename t_reset,
+              typename t_teardown,
+              typename t_run,
+              typename t_updater>
+    void collect_staged(int init_input_sz,
+                        int num_runs,
+                        t_setup setup,
+                        t_reset reset,
+                        t_teardown teardown,
+                        t_run run,
+                        t_updater u);
+
+    // Compare two implementations of the same function on one input size.
+    //
+    // Samples of run_a and run_b are taken in pairs, in random order within
+    // each pair, with the same counter, batch factor and start/stop, so that
+    // drift in frequency, temperature or neighbours hits both alike. After
+    // every round the two estimates are compared as by comparator, with A as
+    // the baseline, and collection stops as soon as the verdict is FASTER or
+    // SLOWER, or once both estimates have converged with no significant
+    // difference, or after max_rounds. A difference well above beta_min is
+    // typically resolved long before either side would converge on its own.
+    //
+    // Checking the verdict every round makes a false FASTER or SLOWER
+    // somewhat more likely than alpha. Samples are not logged, see
+    // set_sample_log().
+    //
+    // u - called once as u(input_sz, a, b, v) where a and b are the estimator
+    //   of each side and v the comparator::verdict of B against A
+    template <typename t_start,
+              typename t_stop,
+              typename t_run_a,
+              typename t_run_b,
+              typename t_updater>
+    void collect_ab(int input_sz,
+                    t_start start,
+                    t_stop stop,
+                    t_run_a run_a,
+                    t_run_b run_b,
+                    t_updater u);
+
+    // Batch several calls to run() into one counter window.
+    //
+    // For kernels that are only a few hundred instructions long the counter
+    // overhead is larger than the signal. With batching each sample brackets
+    // k back-to-back calls to run(N), between a single start(N) and stop(N),
+    // and the values handed to the updater are per call: sum and L_hat are
+    // divided by k, n_tot counts windows.
+    //
+    // The location being estimated is then that of the per-call window
+    // average, which is also a shifted distribution with the same floor L
+    // once the fixed counter cost is amortized over k calls. Since beta only
+    // depends on lam_hat * L_hat, which is invariant to the 1/k scaling, the
+    // stopping rule is unchanged.
+    //
+    // k >= 1 - run(N) is called k times per window, 1 is the default
+    // k == 0 - k is calibrated for every input size by doubling it until one
+    //          window reaches target counts of the counter being minimized
+    //          (instructions, or task-clock ns without HW counters, see
+    //          get_target())
+    void set_batch(int k, long long target = 1000000);
+
+    // The batch factor used for the last input size
+    int get_batch() const;
+
+    // The event being minimized
+    const event& get_target() const;
+
+    // How the windows are measured.
+    //
+    // BACKEND_PERF - perf events, read with rdpmc where possible
+    // BACKEND_TSC - the target is event::tsc(), see tsc_timer
+    // BACKEND_CLOCK - the target is event::clock(), see clock_timer
+    //
+    // The backend follows from the first target that is available, so a
+    // target list ending in event::tsc(), event::clock() measures time where
+    // perf events are not allowed. With a timer backend the only count is
+    // the one of the target, in TSC ticks or ns.
     enum {
-        PERF_SW_TASK_CLK   = 0,
-        PERF_SW_CPU_CLK    = 1,
-        PERF_HW_INSTR_CTR  = 2,
-        PERF_HW_CYCLES_CLK = 3
+        BACKEND_PERF  = 0,
+        BACKEND_TSC   = 1,
+        BACKEND_CLOCK = 2
+    };
+    int get_backend() const;
+
+    // The backend in use as text, one of "perf", "perf+rdpmc", "tsc" or
+    // "clock"
+    const char* get_backend_name() const;
+
+    // For an inherit collector, the task-clock summed over all threads divided
+    // by the wall-clock of the windows of the last input size. That is the
+    // average number of CPUs busy in run(), 1 for serial code. Dividing it by
+    // the number of threads run() uses gives the parallel efficiency. Returns
+    // 0 if this isn't an inherit collector.
+    double get_parallelism() const;
+
+    // Spread the input sizes of collect() over several CPUs.
+    //
+    // The input sizes are independent, so with a non-empty list of cpus
+    // collect() starts one worker per cpu, pinned to it and with its own
+    // counter. Workers take the largest outstanding input size first. The
+    // updater is still called on the calling thread and in input-size order,
+    // as soon as all smaller sizes have been delivered, and get_batch() and
+    // get_parallelism() refer to the size being delivered.
+    //
+    // start, stop and run are called concurrently from the workers, so they
+    // must not share state. Use isolated CPUs and keep the calling thread off
+    // them. An empty list, the default, measures on the calling thread.
+    void set_sweep_cpus(std::vector<int> cpus);
+
+    // What collect_for_input_size keeps track of, and when it stops.
+    //
+    // TRACK_TARGET - only the minimized event, the default
+    //
+    // TRACK_ALL - also keep a running sum and minimum of every open event,
+    // see get_estimators() and get_ipc(), but stop as soon as the minimized
+    // event has converged
+    //
+    // TRACK_ALL_CONVERGE - like TRACK_ALL, but only stop once beta <=
+    // beta_min for every open event other than context switches and
+    // migrations. Other events whose minimum is 0 can't meet a relative
+    // bound, so leave them out of the counter in this mode.
+    enum {
+        TRACK_TARGET       = 0,
+        TRACK_ALL          = 1,
+        TRACK_ALL_CONVERGE = 2
+    };
+    void set_tracking(int mode);
+
+    // With TRACK_ALL or TRACK_ALL_CONVERGE, the estimate for every open event
+    // of the last input size, in the order of counter::get_counts().
+    // Otherwise empty.
+    const std::vector<estimator>& get_estimators() const;
+
+    // With TRACK_ALL or TRACK_ALL_CONVERGE, the instructions per cycle of the
+    // fastest windows of the last input size, L_hat(instructions) /
+    // L_hat(cycles). Uses PERF_COUNT_HW_CPU_CYCLES, or
+    // PERF_COUNT_HW_REF_CPU_CYCLES if that's all there is, and is 0 if either
+    // event is missing.
+    double get_ipc() const;
+
+    // With TRACK_ALL or TRACK_ALL_CONVERGE and the events of
+    // topdown::events() open, the top-down breakdown of the last input size,
+    // from the totals of every sample. Returns false if it can't be computed.
+    bool get_topdown(topdown::breakdown& b, int width = 0) const;
+
+    // With TRACK_ALL or TRACK_ALL_CONVERGE, the fewest allocations and bytes
+    // allocated by one call of run() in the last input size, the L_hat of
+    // event::alloc_calls() and event::alloc_bytes(). Those events are counted
+    // on the calling thread when they are among the events and a hook of
+    // alloc.h is installed, and are left out otherwise, like events that
+    // fail to open. With TRACK_ALL_CONVERGE they have to converge like any
+    // other event, unless their L_hat is 0. Returns false if neither is
+    // counted.
+    bool get_allocations(long long& calls, long long& bytes) const;
+
+    // The events that could be opened, in the order of the counts logged by
+    // set_sample_log()
+    std::vector<event> get_events() const;
+
+    // Append every raw sample the estimate uses to log, as
+    //
+    //   log->append(input_sz, round, counts)
+    //
+    // where round is the stopping-rule round of the sample, and counts are
+    // those of the whole window, i.e. not divided by the batch factor.
+    // Warm-up and rejected samples are not logged. The append happens after
+    // stop(N), outside of the counter window. The log is
+    // not owned and must outlive collect(), nullptr turns logging off.
+    void set_sample_log(sample_log* log);
+
+    // Reuse the results of earlier runs of the same benchmark.
+    //
+    // name and hash identify the benchmark, see baseline_cache. For every
+    // input size that cache has an entry for, with the same target event,
+    // the first round gathers max(n_init, cached n_tot) samples instead of
+    // n_init, which usually converges at once. With skip the cached result is
+    // handed to the updater without measuring at all, and without calling
+    // the setup and teardown of collect_staged(). Every measured input
+    // size is stored back in cache, call baseline_cache::save() to keep it.
+    //
+    // The cache is not owned and must outlive collect(), nullptr turns it
+    // off.
+    void set_cache(baseline_cache* cache,
+                   std::string name,
+                   uint64_t hash,
+                   bool skip = false);
+
+    // Discard samples before each input size until the caches and the clock
+    // have settled.
+    //
+    // Up to max_samples windows are run and thrown away, stopping early once
+    // stable of them in a row did not lower the smallest count seen by more
+    // than beta_min. 0, the default, turns warm-up off.
+    void set_warmup(int max_samples, int stable = 5);
+
+    // Rerun samples that were disturbed by the scheduler.
+    //
+    // A window that saw a PERF_COUNT_SW_CONTEXT_SWITCHES or
+    // PERF_COUNT_SW_CPU_MIGRATIONS is run again, up to max_rejects times in a
+    // row after which it is kept anyway, so code that always blocks still
+    // terminates. The first constructor opens both events, with the second
+    // add them to events. They count in the kernel, see event::kernel, so
+    // where perf_event_paranoid forbids that they don't open and nothing is
+    // rejected. On by default, and never done in inherit mode where the
+    // threads of run() switch as a matter of course.
+    //
+    // Independently of this, a window in which a group of events was never
+    // on the PMU, see counter::is_unscheduled(), has no counts to speak of
+    // and is always run again, and collecting throws EAGAIN if that happens
+    // max_rejects times in a row.
+    void set_reject_disturbed(bool reject);
+
+    // How many samples of the last input size were rerun, because they were
+    // disturbed or unscheduled
+    int get_rejected() const;
+
+    // Check the stopping rule while a block of n samples is gathered.
+    //
+    // By default beta is only recomputed once all n samples of a round are
+    // in, so the samples after beta dropped below beta_min are wasted. With
+    // k > 0 it is also recomputed after every k samples of a block, once
+    // there are at least min_incr samples, and the input size ends as soon as
+    // it converges. max_checks caps the number of these extra checks per
+    // input size, 0 means no cap. k = 0 turns them off, the default.
+    void set_check_every(int k, int max_checks = 0);
+
+    // Start every input size after the first two at a predicted n instead of
+    // n_init.
+    //
+    // The stopping rule needs n = -log(alpha) * r / beta_min samples, where r
+    // = (xbar - L_hat) / L_hat is the relative spread of the samples. collect()
+    // fits log r against log N over the last two input sizes, with the slope
+    // clamped to [-1, 1], and starts the next one with the n that the
+    // extrapolated r calls for, clamped to what a cold start could reach in
+    // max_rounds. A cached entry, see
+    // set_cache(), takes precedence. Off by default, and not used when
+    // sweeping, where the input sizes are measured out of order.
+    void set_predict_n(bool predict);
+
+    // With set_predict_n(), an estimate of how many samples the last
+    // collect() saved compared to starting every input size at n_init. The
+    // cold start is replayed with the final lam_hat and L_hat of each input
+    // size, so this is negative when the prediction overshot.
+    int get_samples_saved() const;
+
+    // Sample every window of collect() with p's sampler, and rank each input
+    // size's windows into p's near and tail histograms, see profile. The
+    // sampler is started before and stopped after the counter, so its
+    // syscalls are not counted, though its interrupts still perturb time
+    // based targets a little. p's histograms are complete for an input size
+    // by the time the updater receives it. p must have been constructed on
+    // the thread that collects, and is not handed to sweep workers. nullptr,
+    // the default, turns it off.
+    void set_profile(profile* p);
+
+    // The count of the target in an empty window, the least of samples
+    // windows around a run() that does nothing, with the counter, backend
+    // and allocation hooks of this collector. No L_hat can be lower, see
+    // overhead.h for the floors of other read modes and event counts.
+    long long measure_floor(int samples = 1000);
+
+    // Take the floor off what the updater receives.
+    //
+    // The floor is measured with measure_floor() before the first input
+    // size, on the thread, and so the CPU, that collects. L_hat is lowered by
+    // floor / k, where k is the batch factor, and clamped at 0, and sum by
+    // n_tot times that, so the mean moves with it. The stopping rule, the
+    // estimators of set_tracking(), collect_ab(), where the floor cancels,
+    // and the entries of set_cache() all see the raw counts. Off by default.
+    void set_subtract_floor(bool subtract);
+
+    // The floor measured by measure_floor(), or -1 if it hasn't been
+    long long get_floor() const;
+
+  private:
+    // The counts of a sample are kept inline in the counter, so reading them
+    // in the sampling loop never touches the heap. More events than this
+    // make the constructor throw.
+    static const size_t max_events = 32;
+    using counter_t                = fixed_counter<max_events>;
+
+    // Give up rejecting a sample after this many disturbed runs in a row
+    static const int max_rejects = 16;
+
+    // The events opened by the first constructor. Only two of them are HW
+    // events, instructions and cycles, so that the group fits in the fixed
+    // counters of Intel cores, or leaves generic ones over elsewhere, even
+    // with the NMI watchdog holding one. A group that doesn't fit is
+    // multiplexed, and short windows then miss it entirely, see
+    // counter::is_unscheduled(). ref-cycles only stands in for cycles where
+    // those can't be opened.
+    static std::vector<event> default_events();
+
+    // The targets of the first constructor, from the cheapest and most
+    // repeatable to read to the least: HW counters that rdpmc can read inside
+    // the window, then the task-clock and cpu-clock, which need a read() and
+    // count time rather than work, and last the timer backends for when perf
+    // events are not allowed.
+    static std::vector<event> default_targets();
+
+    // Whether the scheduler got in the way of a window
+    bool disturbed(const counter_t::counts_t& c) const;
+
+    // Whether a group of events was off the PMU for all of the last window
+    bool unscheduled() const;
+
+    // Apply the stopping rule to e, and to m_estimators depending on the
+    // tracking mode. Returns true when done, and otherwise sets n to the
+    // number of samples to gather next.
+    bool update(estimator& e, int& n);
+
+    // The n predicted for input_sz from m_spreads, or 0 if there is too
+    // little history, see set_predict_n()
+    int predict_n(int input_sz) const;
+
+    // How many samples a cold start at n_init would have taken to converge,
+    // if every round saw the final estimate of e
+    int cold_start_samples(const estimator& e) const;
+
+    // What a sweep worker hands back for one input size
+    struct sweep_result {
+        double sum;
+        long long L_hat;
+        int n_tot;
+        int batch;
+        double parallelism;
+        std::vector<estimator> estimators;
+        bool ready;
     };
 
+    // Hand our settings to a sweep worker's collector
+    void configure(collector& c) const;
+
     // Wraps the calls to start, stop and run around the internal counter.
     template <typename t_start, typename t_stop, typename t_run>
-    const exp_perf::counter::counts_t& get_counts(int sample_sz,
-                                              t_start start,
-                                              t_stop stop,
-                                              t_run run);
+    const counter_t::counts_t& get_counts(int sample_sz,
+                                          int batch,
+                                          t_start start,
+                                          t_stop stop,
+                                          t_run run);
+
+    // get_counts() for a timer backend
+    template <typename t_timer,
+              typename t_start,
+              typename t_stop,
+              typename t_run>
+    const counter_t::counts_t& time_window(int sample_sz,
+                                           int batch,
+                                           t_start start,
+                                           t_stop stop,
+                                           t_run run);
+
+    // The size of what get_counts() returns
+    size_t get_counts_size() const;
+
+    // c with the allocations between a0 and a1 appended, see m_allocs
+    const counter_t::counts_t& with_allocs(const counter_t::counts_t& c,
+                                           const alloc_counts& a0,
+                                           const alloc_counts& a1);
+
+    // Wall-clock, read around the counter window for inherit collectors
+    static long long now_ns();
+
+    // What set_subtract_floor() takes off each call of a window of batch
+    // calls, measuring the floor first if need be
+    double floor_per_call(int batch);
+
+    // get_counts(), rerun while disturbed or unscheduled, see
+    // set_reject_disturbed()
+    template <typename t_start, typename t_stop, typename t_run>
+    const counter_t::counts_t& sample(int input_sz,
+                                      int batch,
+                                      bool reject,
+                                      t_start start,
+                                      t_stop stop,
+                                      t_run run);
+
+    // Run and discard windows, see set_warmup()
+    template <typename t_start, typename t_stop, typename t_run>
+    void warm_up(int input_sz,
+                 int batch,
+                 t_start start,
+                 t_stop stop,
+                 t_run run);
+
+    // Find the batch factor for this input size, see set_batch()
+    template <typename t_start, typename t_stop, typename t_run>
+    int calibrate_batch(int input_sz, t_start start, t_stop stop, t_run run);
+
+    // init_input_sz doubled num_runs - 1 times
+    static std::vector<int> doubling(int init_input_sz, int num_runs);
+
+    // What collect() and collect_staged() share
+    template <typename t_setup,
+              typename t_teardown,
+              typename t_start,
+              typename t_stop,
+              typename t_run,
+              typename t_updater>
+    void collect_sizes(const std::vector<int>& sizes,
+                       t_setup setup,
+                       t_teardown teardown,
+                       t_start start,
+                       t_stop stop,
+                       t_run run,
+                       t_updater u);
+
+    // collect() over several CPUs, see set_sweep_cpus()
+    template <typename t_setup,
+              typename t_teardown,
+              typename t_start,
+              typename t_stop,
+              typename t_run,
+              typename t_updater>
+    void collect_sweep(const std::vector<int>& sizes,
+                       t_setup setup,
+                       t_teardown teardown,
+                       t_start start,
+                       t_stop stop,
+                       t_run run,
+                       t_updater u);
+
+    // If set_cache() skips input_sz, hand the cached result to u and return
+    // true
+    template <typename t_updater>
+    bool deliver_cached(int input_sz, t_updater& u);
+
+    // collect_for_input_size() between setup and teardown, neither of which
+    // is called for input sizes that deliver_cached() takes
+    template <typename t_setup,
+              typename t_teardown,
+              typename t_start,
+              typename t_stop,
+              typename t_run,
+              typename t_updater>
+    void collect_staged_size(int input_sz,
+                             t_setup& setup,
+                             t_teardown& teardown,
+                             t_start start,
+                             t_stop stop,
+                             t_run run,
+                             t_updater u);
 
     // Most of the algorithm implemented here, for each input size.
     template <typename t_start,
@@ -100,14 +618,52 @@ class collector
                                 t_run run,
                                 t_updater u);
 
-    int m_ctr_idx;  // The index of the counter we are using
+    int m_backend;
+    int m_ctr_idx;   // The index of the counter we are using
+    int m_task_idx;  // The index of task-clock, or -1
+    int m_instr_idx;   // The index of instructions, or -1
+    int m_cycles_idx;  // The index of cycles, or -1
+    int m_switch_idx;     // The index of context switches, or -1
+    int m_migration_idx;  // The index of CPU migrations, or -1
     const double m_alpha;
     const double m_beta_min;
     const int m_min_incr;
     const int m_max_incr;
     const int m_max_rounds;
     const int m_n_init;
-    counter m_counter;
+    int m_batch;
+    long long m_batch_target;
+    int m_last_batch;
+    const bool m_inherit;
+    long long m_wall_ns;  // Wall-clock of the last window for inherit
+    double m_last_parallelism;
+    std::vector<int> m_sweep_cpus;
+    int m_tracking;
+    std::vector<estimator> m_estimators;
+    sample_log* m_log;
+    baseline_cache* m_cache;
+    std::string m_cache_name;
+    uint64_t m_cache_hash;
+    bool m_cache_skip;
+    int m_warmup;
+    int m_warmup_stable;
+    bool m_reject;
+    int m_rejected;
+    int m_check_every;
+    int m_max_checks;
+    bool m_predict;
+    std::vector<std::pair<int, double>> m_spreads;  // input_sz, r
+    int m_samples_saved;
+    profile* m_profile;
+    bool m_subtract_floor;
+    long long m_floor;
+    const std::vector<event> m_events;
+    const std::vector<event> m_targets;
+    counter_t m_counter;
+    event m_target;
+    counter_t::counts_t m_timer_counts;  // What a timer backend measured
+    std::vector<event> m_allocs;  // The alloc events counted, after the rest
+    counter_t::counts_t m_alloc_counts;  // What with_allocs() returns
 };
 
 inline collector::collector(double alpha,
@@ -115,24 +671,459 @@ inline collector::collector(double alpha,
                             int min_incr,
                             int max_incr,
                             int max_rounds,
-                            int n_init)
-    : m_ctr_idx(-1)
+                            int n_init,
+                            bool inherit)
+    : collector(alpha,
+                beta_min,
+                min_incr,
+                max_incr,
+                max_rounds,
+                n_init,
+                default_events(),
+                default_targets(),
+                inherit)
+{
+}
+
+inline collector::collector(double alpha,
+                            double beta_min,
+                            int min_incr,
+                            int max_incr,
+                            int max_rounds,
+                            int n_init,
+                            std::vector<event> events,
+                            std::vector<event> targets,
+                            bool inherit)
+    : m_backend(BACKEND_PERF)
+    , m_ctr_idx(-1)
+    , m_task_idx(-1)
+    , m_instr_idx(-1)
+    , m_cycles_idx(-1)
+    , m_switch_idx(-1)
+    , m_migration_idx(-1)
     , m_alpha(alpha)
     , m_beta_min(beta_min)
     , m_min_incr(min_incr)
     , m_max_incr(max_incr)
     , m_max_rounds(max_rounds)
     , m_n_init(n_init)
-    , m_counter({PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_CPU_CLOCK},
-                {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_REF_CPU_CYCLES})
+    , m_batch(1)
+    , m_batch_target(0)
+    , m_last_batch(1)
+    , m_inherit(inherit)
+    , m_wall_ns(0)
+    , m_last_parallelism(0)
+    , m_tracking(TRACK_TARGET)
+    , m_log(nullptr)
+    , m_cache(nullptr)
+    , m_cache_hash(0)
+    , m_cache_skip(false)
+    , m_warmup(0)
+    , m_warmup_stable(5)
+    , m_reject(true)
+    , m_rejected(0)
+    , m_check_every(0)
+    , m_max_checks(0)
+    , m_predict(false)
+    , m_samples_saved(0)
+    , m_profile(nullptr)
+    , m_subtract_floor(false)
+    , m_floor(-1)
+    , m_events(std::move(events))
+    , m_targets(std::move(targets))
+    , m_counter(m_events, counter::READ_RDPMC, inherit)
+{
+    for (size_t i = 0; i < m_targets.size() && m_ctr_idx < 0; ++i) {
+        const event& t = m_targets[i];
+        if (t.type == event::TYPE_TSC && tsc_timer::available()) {
+            m_backend = BACKEND_TSC;
+            m_ctr_idx = 0;
+        } else if (t.type == event::TYPE_CLOCK && clock_timer::available()) {
+            m_backend = BACKEND_CLOCK;
+            m_ctr_idx = 0;
+        } else {
+            m_ctr_idx = m_counter.find(t);
+        }
+        m_target = t;
+    }
+    if (m_ctr_idx < 0) {
+        throw std::system_error(ENOENT, std::system_category());
+    }
+    for (const auto& e : m_events) {
+        if (e.is_alloc() && allocations::hooked()) {
+            m_allocs.push_back(e);
+        }
+    }
+    if (m_backend != BACKEND_PERF) {
+        // The counter's events are not part of the counts
+        m_timer_counts.push_back(0);
+        return;
+    }
+    m_task_idx   = m_counter.find(event::sw(PERF_COUNT_SW_TASK_CLOCK));
+    m_instr_idx  = m_counter.find(event::hw(PERF_COUNT_HW_INSTRUCTIONS));
+    m_cycles_idx = m_counter.find(event::hw(PERF_COUNT_HW_CPU_CYCLES));
+    if (m_cycles_idx < 0) {
+        m_cycles_idx = m_counter.find(event::hw(PERF_COUNT_HW_REF_CPU_CYCLES));
+    }
+    m_switch_idx = m_counter.find(event::sw(PERF_COUNT_SW_CONTEXT_SWITCHES));
+    m_migration_idx =
+        m_counter.find(event::sw(PERF_COUNT_SW_CPU_MIGRATIONS));
+}
+
+inline std::vector<event>
+collector::default_events()
+{
+    const event cycles = event::hw(PERF_COUNT_HW_CPU_CYCLES);
+    const bool has_cycles =
+        counter(std::vector<event>{cycles}).get_counts_size() > 0;
+    return {event::sw(PERF_COUNT_SW_TASK_CLOCK),
+            event::sw(PERF_COUNT_SW_CPU_CLOCK),
+            event::hw(PERF_COUNT_HW_INSTRUCTIONS),
+            has_cycles ? cycles : event::hw(PERF_COUNT_HW_REF_CPU_CYCLES),
+            event::sw(PERF_COUNT_SW_CONTEXT_SWITCHES),
+            event::sw(PERF_COUNT_SW_CPU_MIGRATIONS)};
+}
+
+inline std::vector<event>
+collector::default_targets()
+{
+    return {event::hw(PERF_COUNT_HW_INSTRUCTIONS),
+            event::hw(PERF_COUNT_HW_CPU_CYCLES),
+            event::hw(PERF_COUNT_HW_REF_CPU_CYCLES),
+            event::sw(PERF_COUNT_SW_TASK_CLOCK),
+            event::sw(PERF_COUNT_SW_CPU_CLOCK),
+            event::tsc(),
+            event::clock()};
+}
+
+inline bool
+collector::disturbed(const counter_t::counts_t& c) const
+{
+    return (m_switch_idx >= 0 && c[m_switch_idx] > 0) ||
+           (m_migration_idx >= 0 && c[m_migration_idx] > 0);
+}
+
+inline bool
+collector::unscheduled() const
+{
+    return m_backend == BACKEND_PERF && m_counter.is_unscheduled();
+}
+
+inline void
+collector::set_batch(int k, long long target)
+{
+    m_batch        = k < 0 ? 1 : k;
+    m_batch_target = target;
+}
+
+inline int
+collector::get_batch() const
+{
+    return m_last_batch;
+}
+
+inline const event&
+collector::get_target() const
+{
+    return m_target;
+}
+
+inline int
+collector::get_backend() const
+{
+    return m_backend;
+}
 
+inline const char*
+collector::get_backend_name() const
 {
-    m_ctr_idx = PERF_SW_TASK_CLK;
-    if (m_counter.get_status(PERF_HW_INSTR_CTR)) {
-        m_ctr_idx = PERF_HW_INSTR_CTR;
+    switch (m_backend) {
+    case BACKEND_TSC:
+        return "tsc";
+    case BACKEND_CLOCK:
+        return "clock";
+    default:
+        return m_counter.get_read_mode() == counter::READ_RDPMC ? "perf+rdpmc"
+                                                                : "perf";
     }
 }
 
+inline size_t
+collector::get_counts_size() const
+{
+    const size_t n =
+        m_backend == BACKEND_PERF ? m_counter.get_counts_size() : 1;
+    return n + m_allocs.size();
+}
+
+inline double
+collector::get_parallelism() const
+{
+    return m_last_parallelism;
+}
+
+inline void
+collector::set_sweep_cpus(std::vector<int> cpus)
+{
+    m_sweep_cpus = std::move(cpus);
+}
+
+inline void
+collector::set_tracking(int mode)
+{
+    m_tracking = mode;
+}
+
+inline const std::vector<estimator>&
+collector::get_estimators() const
+{
+    return m_estimators;
+}
+
+inline double
+collector::get_ipc() const
+{
+    if (m_estimators.empty() || m_instr_idx < 0 || m_cycles_idx < 0) {
+        return 0;
+    }
+    const long long cycles = m_estimators[m_cycles_idx].get_L_hat();
+    return cycles > 0
+               ? (double)m_estimators[m_instr_idx].get_L_hat() / cycles
+               : 0;
+}
+
+inline bool
+collector::get_topdown(topdown::breakdown& b, int width) const
+{
+    if (m_estimators.empty()) {
+        return false;
+    }
+    std::vector<double> totals;
+    for (const auto& e : m_estimators) {
+        totals.push_back(e.get_sum());
+    }
+    return topdown::compute(get_events(), totals, b, width);
+}
+
+inline bool
+collector::get_allocations(long long& calls, long long& bytes) const
+{
+    calls = 0;
+    bytes = 0;
+    if (m_estimators.empty() || m_allocs.empty()) {
+        return false;
+    }
+    const size_t base = m_estimators.size() - m_allocs.size();
+    for (size_t i = 0; i < m_allocs.size(); ++i) {
+        const long long L_hat = m_estimators[base + i].get_L_hat();
+        (m_allocs[i].type == event::TYPE_ALLOC_CALLS ? calls : bytes) = L_hat;
+    }
+    return true;
+}
+
+inline std::vector<event>
+collector::get_events() const
+{
+    std::vector<event> evts;
+    if (m_backend != BACKEND_PERF) {
+        evts.push_back(m_target);
+    } else {
+        for (size_t i = 0; i < m_counter.get_counts_size(); ++i) {
+            evts.push_back(m_counter.get_event(i));
+        }
+    }
+    evts.insert(evts.end(), m_allocs.begin(), m_allocs.end());
+    return evts;
+}
+
+inline void
+collector::set_sample_log(sample_log* log)
+{
+    m_log = log;
+}
+
+inline void
+collector::set_cache(baseline_cache* cache,
+                     std::string name,
+                     uint64_t hash,
+                     bool skip)
+{
+    m_cache      = cache;
+    m_cache_name = std::move(name);
+    m_cache_hash = hash;
+    m_cache_skip = skip;
+}
+
+inline void
+collector::set_warmup(int max_samples, int stable)
+{
+    m_warmup        = max_samples;
+    m_warmup_stable = stable;
+}
+
+inline void
+collector::set_reject_disturbed(bool reject)
+{
+    m_reject = reject;
+}
+
+inline int
+collector::get_rejected() const
+{
+    return m_rejected;
+}
+
+inline void
+collector::set_check_every(int k, int max_checks)
+{
+    m_check_every = k < 0 ? 0 : k;
+    m_max_checks  = max_checks;
+}
+
+inline bool
+collector::update(estimator& e, int& n)
+{
+    bool done = e.update();
+    n         = e.get_next_n();
+    for (size_t j = 0; j < m_estimators.size(); ++j) {
+        // Keep every estimate current, but with TRACK_ALL only the target
+        // decides. Context switches and migrations are mostly 0, and have no
+        // relative bound to meet, nor does any event, like page faults or
+        // allocations, when the fastest calls make none.
+        estimator& x      = m_estimators[j];
+        const bool x_done = x.update() || (int)j == m_switch_idx ||
+                            (int)j == m_migration_idx || x.get_L_hat() == 0;
+        if (m_tracking == TRACK_ALL_CONVERGE && !x_done) {
+            n    = done ? x.get_next_n() : std::max(n, x.get_next_n());
+            done = false;
+        }
+    }
+    return done;
+}
+
+inline void
+collector::set_predict_n(bool predict)
+{
+    m_predict = predict;
+}
+
+inline int
+collector::get_samples_saved() const
+{
+    return m_samples_saved;
+}
+
+inline void
+collector::set_profile(profile* p)
+{
+    m_profile = p;
+}
+
+inline long long
+collector::measure_floor(int samples)
+{
+    auto nop         = [](int) {};
+    profile* const p = m_profile;
+    m_profile        = nullptr;
+    long long floor  = 0;
+    for (int i = 0; i < samples; ++i) {
+        const long long x = sample(0, 1, false, nop, nop, nop)[m_ctr_idx];
+        floor             = i == 0 ? x : std::min(floor, x);
+    }
+    m_profile = p;
+    m_floor   = std::max(0LL, floor);
+    return m_floor;
+}
+
+inline void
+collector::set_subtract_floor(bool subtract)
+{
+    m_subtract_floor = subtract;
+}
+
+inline long long
+collector::get_floor() const
+{
+    return m_floor;
+}
+
+inline double
+collector::floor_per_call(int batch)
+{
+    if (!m_subtract_floor) {
+        return 0;
+    }
+    if (m_floor < 0) {
+        measure_floor();
+    }
+    return (double)m_floor / std::max(1, batch);
+}
+
+inline int
+collector::predict_n(int input_sz) const
+{
+    const size_t k = m_spreads.size();
+    if (k < 2) {
+        return 0;
+    }
+    const double x0 = std::log((double)m_spreads[k - 2].first);
+    const double x1 = std::log((double)m_spreads[k - 1].first);
+    const double y0 = std::log(m_spreads[k - 2].second);
+    const double y1 = std::log(m_spreads[k - 1].second);
+    if (x1 == x0) {
+        return 0;
+    }
+    // A spread that moves faster than N is taken as noise
+    const double slope =
+        std::max(-1., std::min(1., (y1 - y0) / (x1 - x0)));
+    const double r = std::exp(y1 + slope * (std::log((double)input_sz) - x1));
+    const double n = -std::log(m_alpha) * r / m_beta_min;
+    // No more than a cold start could get to
+    const double max_n = m_n_init + (double)m_max_incr * (m_max_rounds - 1);
+    return (int)std::ceil(std::max((double)m_min_incr, std::min(n, max_n)));
+}
+
+inline int
+collector::cold_start_samples(const estimator& e) const
+{
+    const double L_hat = (double)e.get_L_hat();
+    const double xbar  = e.get_n_tot() > 0 ? e.get_sum() / e.get_n_tot() : 0;
+    if (L_hat <= 0 || xbar <= L_hat) {
+        return m_n_init;
+    }
+    // The same steps as estimator::update()
+    const int need = (int)(-std::log(m_alpha) * (xbar - L_hat) /
+                           (m_beta_min * L_hat));
+    int n_tot = 0;
+    int n     = m_n_init;
+    for (int round = 0; round < m_max_rounds && n_tot < need; ++round) {
+        n_tot += n;
+        n = std::min(std::max(need - n_tot, m_min_incr), m_max_incr);
+    }
+    return n_tot;
+}
+
+inline void
+collector::configure(collector& c) const
+{
+    c.set_batch(m_batch, m_batch_target);
+    c.set_tracking(m_tracking);
+    c.set_sample_log(m_log);
+    c.set_cache(m_cache, m_cache_name, m_cache_hash, m_cache_skip);
+    c.set_warmup(m_warmup, m_warmup_stable);
+    c.set_reject_disturbed(m_reject);
+    c.set_check_every(m_check_every, m_max_checks);
+    c.set_subtract_floor(m_subtract_floor);
+}
+
+inline long long
+collector::now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 template <typename t_start, typename t_stop, typename t_run, typename t_updater>
 void
 collector::collect(int N,
@@ -142,21 +1133,368 @@ collector::collect(int N,
                    t_run run,
                    t_updater u)
 {
+    const auto none = [](int) {};
+    collect_sizes(doubling(N, num_runs), none, none, start, stop, run, u);
+}
+
+template <typename t_start, typename t_stop, typename t_run, typename t_updater>
+void
+collector::collect(const std::vector<int>& sizes,
+                   t_start start,
+                   t_stop stop,
+                   t_run run,
+                   t_updater u)
+{
+    const auto none = [](int) {};
+    collect_sizes(sizes, none, none, start, stop, run, u);
+}
+
+template <typename t_setup,
+          typename t_reset,
+          typename t_teardown,
+          typename t_run,
+          typename t_updater>
+void
+collector::collect_staged(int N,
+                          int num_runs,
+                          t_setup setup,
+                          t_reset reset,
+                          t_teardown teardown,
+                          t_run run,
+                          t_updater u)
+{
+    const auto none = [](int) {};
+    collect_sizes(doubling(N, num_runs), setup, teardown, reset, none, run, u);
+}
+
+template <typename t_setup,
+          typename t_teardown,
+          typename t_start,
+          typename t_stop,
+          typename t_run,
+          typename t_updater>
+void
+collector::collect_sizes(const std::vector<int>& sizes,
+                         t_setup setup,
+                         t_teardown teardown,
+                         t_start start,
+                         t_stop stop,
+                         t_run run,
+                         t_updater u)
+{
+    if (!m_sweep_cpus.empty()) {
+        collect_sweep(sizes, setup, teardown, start, stop, run, u);
+        return;
+    }
+    m_spreads.clear();
+    m_samples_saved = 0;
+    for (int N : sizes) {
+        collect_staged_size(N, setup, teardown, start, stop, run, u);
+    }
+}
+
+inline std::vector<int>
+collector::doubling(int N, int num_runs)
+{
+    std::vector<int> sizes;
     for (int i = 0; i < num_runs; ++i, N *= 2) {
+        sizes.push_back(N);
+    }
+    return sizes;
+}
+
+template <typename t_updater>
+bool
+collector::deliver_cached(int input_sz, t_updater& u)
+{
+    baseline_cache::entry cached;
+    if (m_cache == nullptr || !m_cache_skip ||
+        !m_cache->find(
+            m_cache_name, m_cache_hash, input_sz, get_target(), cached)) {
+        return false;
+    }
+    m_estimators.clear();
+    m_last_batch       = cached.batch;
+    m_last_parallelism = 0;
+    const double f     = floor_per_call(cached.batch);
+    u(input_sz,
+      cached.sum - f * cached.n_tot,
+      std::max(0LL, cached.L_hat - std::llround(f)),
+      cached.n_tot);
+    return true;
+}
+
+template <typename t_setup,
+          typename t_teardown,
+          typename t_start,
+          typename t_stop,
+          typename t_run,
+          typename t_updater>
+void
+collector::collect_staged_size(int N,
+                               t_setup& setup,
+                               t_teardown& teardown,
+                               t_start start,
+                               t_stop stop,
+                               t_run run,
+                               t_updater u)
+{
+    if (deliver_cached(N, u)) {
+        return;
+    }
+    setup(N);
+    try {
         collect_for_input_size(N, start, stop, run, u);
+    } catch (...) {
+        teardown(N);
+        throw;
+    }
+    teardown(N);
+}
+
+template <typename t_setup,
+          typename t_teardown,
+          typename t_start,
+          typename t_stop,
+          typename t_run,
+          typename t_updater>
+void
+collector::collect_sweep(const std::vector<int>& sizes,
+                         t_setup setup,
+                         t_teardown teardown,
+                         t_start start,
+                         t_stop stop,
+                         t_run run,
+                         t_updater u)
+{
+    const int num_runs = (int)sizes.size();
+    std::vector<sweep_result> results(num_runs);
+    std::atomic<int> next(num_runs);
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::exception_ptr error;
+
+    auto worker = [&](int cpu) {
+        try {
+            pin_self(cpu);
+            // A collector of our own, so that the counter belongs to this
+            // thread
+            collector c(m_alpha,
+                        m_beta_min,
+                        m_min_incr,
+                        m_max_incr,
+                        m_max_rounds,
+                        m_n_init,
+                        m_events,
+                        m_targets,
+                        m_inherit);
+            configure(c);
+            for (int i = --next; i >= 0; i = --next) {
+                c.collect_staged_size(
+                    sizes[i],
+                    setup,
+                    teardown,
+                    start,
+                    stop,
+                    run,
+                    [&](int, double sum, long long L_hat, int n_tot) {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        results[i] = {sum,
+                                      L_hat,
+                                      n_tot,
+                                      c.m_last_batch,
+                                      c.m_last_parallelism,
+                                      c.m_estimators,
+                                      true};
+                        cv.notify_one();
+                    });
+                std::lock_guard<std::mutex> lock(mtx);
+                if (error != nullptr) {
+                    break;
+                }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (error == nullptr) {
+                error = std::current_exception();
+            }
+            next = -1;
+            cv.notify_one();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    try {
+        for (int cpu : m_sweep_cpus) {
+            threads.emplace_back(worker, cpu);
+        }
+
+        // Deliver in order, without holding the lock while the updater runs
+        for (int i = 0; i < num_runs; ++i) {
+            sweep_result r;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock,
+                        [&] { return results[i].ready || error != nullptr; });
+                if (error != nullptr) {
+                    break;
+                }
+                r = results[i];
+            }
+            m_last_batch       = r.batch;
+            m_last_parallelism = r.parallelism;
+            m_estimators       = std::move(r.estimators);
+            u(sizes[i], r.sum, r.L_hat, r.n_tot);
+        }
+    } catch (...) {
+        // Stop the workers after their current input size, so that they can
+        // be joined
+        std::lock_guard<std::mutex> lock(mtx);
+        if (error == nullptr) {
+            error = std::current_exception();
+        }
+        next = -1;
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+    if (error != nullptr) {
+        std::rethrow_exception(error);
     }
 }
 
 template <typename t_start, typename t_stop, typename t_run>
-const exp_perf::counter::counts_t&
-collector::get_counts(int N, t_start start, t_stop stop, t_run run)
+const collector::counter_t::counts_t&
+collector::get_counts(int N, int batch, t_start start, t_stop stop, t_run run)
 {
+    if (m_backend == BACKEND_TSC) {
+        return time_window<tsc_timer>(N, batch, start, stop, run);
+    } else if (m_backend == BACKEND_CLOCK) {
+        return time_window<clock_timer>(N, batch, start, stop, run);
+    }
     start(N);
+    if (m_profile != nullptr) {
+        m_profile->get_sampler().start();
+    }
+    alloc_counts a0 = {0, 0}, a1 = {0, 0};
+    if (!m_allocs.empty()) {
+        a0 = allocations::get();
+    }
+    const long long t0 = m_inherit ? now_ns() : 0;
     m_counter.start();
-    run(N);
+    for (int k = 0; k < batch; ++k) {
+        run(N);
+    }
     m_counter.stop();
+    m_wall_ns = m_inherit ? now_ns() - t0 : 0;
+    if (!m_allocs.empty()) {
+        a1 = allocations::get();
+    }
+    if (m_profile != nullptr) {
+        m_profile->get_sampler().stop();
+    }
+    stop(N);
+    return m_allocs.empty() ? m_counter.get_counts()
+                            : with_allocs(m_counter.get_counts(), a0, a1);
+}
+
+template <typename t_timer, typename t_start, typename t_stop, typename t_run>
+const collector::counter_t::counts_t&
+collector::time_window(int N, int batch, t_start start, t_stop stop, t_run run)
+{
+    start(N);
+    if (m_profile != nullptr) {
+        m_profile->get_sampler().start();
+    }
+    alloc_counts a0 = {0, 0}, a1 = {0, 0};
+    if (!m_allocs.empty()) {
+        a0 = allocations::get();
+    }
+    const long long t0 = t_timer::begin();
+    for (int k = 0; k < batch; ++k) {
+        run(N);
+    }
+    const long long t1 = t_timer::end();
+    if (!m_allocs.empty()) {
+        a1 = allocations::get();
+    }
+    if (m_profile != nullptr) {
+        m_profile->get_sampler().stop();
+    }
     stop(N);
-    return m_counter.get_counts();
+    m_timer_counts[0] = t1 - t0;
+    return m_allocs.empty() ? m_timer_counts
+                            : with_allocs(m_timer_counts, a0, a1);
+}
+
+inline const collector::counter_t::counts_t&
+collector::with_allocs(const counter_t::counts_t& c,
+                       const alloc_counts& a0,
+                       const alloc_counts& a1)
+{
+    m_alloc_counts = c;
+    for (const auto& e : m_allocs) {
+        m_alloc_counts.push_back(e.type == event::TYPE_ALLOC_CALLS
+                                     ? (long long)(a1.calls - a0.calls)
+                                     : (long long)(a1.bytes - a0.bytes));
+    }
+    return m_alloc_counts;
+}
+
+template <typename t_start, typename t_stop, typename t_run>
+const collector::counter_t::counts_t&
+collector::sample(int N,
+                  int batch,
+                  bool reject,
+                  t_start start,
+                  t_stop stop,
+                  t_run run)
+{
+    const counter_t::counts_t& c = get_counts(N, batch, start, stop, run);
+    // c refers to the counts get_counts() returns, so rerunning updates it
+    for (int r = 0;
+         r < max_rejects && (unscheduled() || (reject && disturbed(c)));
+         ++r) {
+        ++m_rejected;
+        get_counts(N, batch, start, stop, run);
+    }
+    if (unscheduled()) {
+        // Counts of 0 would pass for a new minimum
+        throw std::system_error(EAGAIN, std::system_category());
+    }
+    return c;
+}
+
+template <typename t_start, typename t_stop, typename t_run>
+void
+collector::warm_up(int N, int batch, t_start start, t_stop stop, t_run run)
+{
+    long long best = 0;
+    int stable     = 0;
+    for (int i = 0; i < m_warmup && stable < m_warmup_stable; ++i) {
+        const long long x =
+            sample(N, batch, false, start, stop, run)[m_ctr_idx];
+        if (i == 0 || x < best * (1 - m_beta_min)) {
+            stable = 0;
+        } else {
+            ++stable;
+        }
+        best = i == 0 ? x : std::min(best, x);
+    }
+}
+
+template <typename t_start, typename t_stop, typename t_run>
+int
+collector::calibrate_batch(int N, t_start start, t_stop stop, t_run run)
+{
+    const int max_batch = 1 << 20;
+    int k               = 1;
+    while (k < max_batch &&
+           sample(N, k, false, start, stop, run)[m_ctr_idx] < m_batch_target) {
+        k *= 2;
+    }
+    return k;
 }
 
 template <typename t_start, typename t_stop, typename t_run, typename t_updater>
@@ -167,54 +1505,157 @@ collector::collect_for_input_size(int input_sz,
                                   t_run run,
                                   t_updater u)
 {
-    int n           = m_n_init;
-    double sum      = 0;
-    long long L_hat = 0;
-    int n_tot       = 0;
-    double beta     = m_beta_min + 1;
-    double xbar     = 0;
-    double lam_hat  = 0;
-    double fac      = 0;
-    for (int i = 0; i < m_max_rounds; ++i) {
+    baseline_cache::entry cached;
+    const bool hit = m_cache != nullptr && m_cache->find(m_cache_name,
+                                                         m_cache_hash,
+                                                         input_sz,
+                                                         get_target(),
+                                                         cached);
+    const int K = m_batch > 0 ? m_batch
+                              : calibrate_batch(input_sz, start, stop, run);
+    const double f = floor_per_call(K);
+    warm_up(input_sz, K, start, stop, run);
+    estimator e(m_alpha, m_beta_min, m_min_incr, m_max_incr);
+    // Loop invariant, so that the compiler can keep it in a register
+    const int ctr_idx     = m_ctr_idx;
+    const bool track_all  = m_tracking != TRACK_TARGET;
+    const bool reject     = m_reject && !m_inherit;
+    const int check_every = m_check_every;
+    m_rejected            = 0;
+    m_estimators.clear();
+    if (track_all) {
+        m_estimators.resize(get_counts_size(), e);
+    }
+    double wall_ns = 0;
+    double task_ns = 0;
+    const int predicted = m_predict && !hit ? predict_n(input_sz) : 0;
+    int n = hit ? std::max(m_n_init, cached.n_tot)
+                : predicted > 0 ? predicted : m_n_init;
+    int checks     = 0;
+    bool done      = false;
+    for (int round = 0; round < m_max_rounds; ++round) {
         // Gather counts based on the current value of n
-        for (int i = 0; i <= n; ++i) {
-            long long cnt = get_counts(input_sz, start, stop, run)[m_ctr_idx];
-            sum += cnt;
-            if (i == 0 || cnt < L_hat) {
-                L_hat = cnt;
+        for (int i = 0; i < n && !done; ++i) {
+            const counter_t::counts_t& c =
+                sample(input_sz, K, reject, start, stop, run);
+            if (m_log != nullptr) {
+                m_log->append(input_sz, round, c);
+            }
+            if (m_profile != nullptr) {
+                m_profile->add(c[ctr_idx]);
+            }
+            e.add(c[ctr_idx], K);
+            if (track_all) {
+                for (size_t j = 0; j < c.size(); ++j) {
+                    m_estimators[j].add(c[j], K);
+                }
+            }
+            if (m_inherit && m_task_idx >= 0) {
+                wall_ns += m_wall_ns;
+                task_ns += c[m_task_idx];
+            }
+            if (check_every > 0 && (i + 1) % check_every == 0 &&
+                i + 1 < n && e.get_n_tot() >= m_min_incr &&
+                (m_max_checks == 0 || checks < m_max_checks)) {
+                // The next n only matters at the end of a block
+                int next;
+                ++checks;
+                done = update(e, next);
             }
         }
-
-        // Calculate the beta estimate
-        n_tot   = n_tot + n;
-        xbar    = sum / n_tot;
-        lam_hat = 1. / (xbar - L_hat);
-        fac     = n_tot * lam_hat * L_hat;
-        beta    = -std::log(m_alpha) / fac;
-        if (beta <= m_beta_min) {
+        if (done || update(e, n)) {
             break;
         }
+    }
+    m_last_batch       = K;
+    m_last_parallelism = wall_ns > 0 ? task_ns / wall_ns : 0;
+    if (m_profile != nullptr) {
+        m_profile->end_input_size();
+    }
+    if (m_cache != nullptr) {
+        m_cache->store(m_cache_name,
+                       m_cache_hash,
+                       input_sz,
+                       get_target(),
+                       {e.get_sum(),
+                        e.get_L_hat(),
+                        e.get_lam_hat(),
+                        e.get_n_tot(),
+                        K});
+    }
+    if (m_predict) {
+        const double xbar = e.get_sum() / e.get_n_tot();
+        if (e.get_L_hat() > 0 && xbar > e.get_L_hat()) {
+            m_spreads.emplace_back(input_sz,
+                                   (xbar - e.get_L_hat()) / e.get_L_hat());
+        }
+        if (predicted > 0) {
+            m_samples_saved += cold_start_samples(e) - e.get_n_tot();
+        }
+    }
+    u(input_sz,
+      e.get_sum() - f * e.get_n_tot(),
+      std::max(0LL, e.get_L_hat() - std::llround(f)),
+      e.get_n_tot());
+}
 
-        // To get the new N, estimate what n should be based off the beta we
-        // calculated and use this as a guide to see how many more we should
-        // gather.
-        fac       = lam_hat * m_beta_min * L_hat;
-        int new_n = (int)(-std::log(m_alpha) / fac);
-        if (new_n < n_tot) {
-            // Our forumlas don't work anymore, gather min_incr until
-            // something good happens, or we exceed the loop_cnt
-            n = m_min_incr;
-        } else {
-            // Only gather a clamped number of samples.
-            n = new_n - n_tot;
-            if (n > m_max_incr) {
-                n = m_max_incr;
-            } else if (n < m_min_incr) {
-                n = m_min_incr;
+template <typename t_start,
+          typename t_stop,
+          typename t_run_a,
+          typename t_run_b,
+          typename t_updater>
+void
+collector::collect_ab(int input_sz,
+                      t_start start,
+                      t_stop stop,
+                      t_run_a run_a,
+                      t_run_b run_b,
+                      t_updater u)
+{
+    // Calibrate and warm up on A, B gets the same batch factor
+    const int K = m_batch > 0 ? m_batch
+                              : calibrate_batch(input_sz, start, stop, run_a);
+    warm_up(input_sz, K, start, stop, run_a);
+    warm_up(input_sz, K, start, stop, run_b);
+    estimator a(m_alpha, m_beta_min, m_min_incr, m_max_incr);
+    estimator b(m_alpha, m_beta_min, m_min_incr, m_max_incr);
+    const comparator cmp(m_alpha, m_beta_min);
+    const int ctr_idx = m_ctr_idx;
+    const bool reject = m_reject && !m_inherit;
+    std::minstd_rand rng(std::random_device{}());
+    m_rejected = 0;
+    m_estimators.clear();
+
+    comparator::verdict v = {};
+    int n                 = m_n_init;
+    for (int round = 0; round < m_max_rounds; ++round) {
+        for (int i = 0; i < n; ++i) {
+            if (rng() & 1) {
+                a.add(sample(input_sz, K, reject, start, stop, run_a)[ctr_idx],
+                      K);
+                b.add(sample(input_sz, K, reject, start, stop, run_b)[ctr_idx],
+                      K);
+            } else {
+                b.add(sample(input_sz, K, reject, start, stop, run_b)[ctr_idx],
+                      K);
+                a.add(sample(input_sz, K, reject, start, stop, run_a)[ctr_idx],
+                      K);
             }
         }
+        const bool a_done = a.update();
+        const bool b_done = b.update();
+        v                 = cmp.compare(
+            input_sz,
+            results::summary{a.get_sum(), a.get_L_hat(), a.get_n_tot()},
+            results::summary{b.get_sum(), b.get_L_hat(), b.get_n_tot()});
+        if (v.result != comparator::SAME || (a_done && b_done)) {
+            break;
+        }
+        n = std::max(a_done ? 0 : a.get_next_n(), b_done ? 0 : b.get_next_n());
     }
-    u(input_sz, sum, L_hat, n_tot);
+    m_last_batch       = K;
+    m_last_parallelism = 0;
+    u(input_sz, a, b, v);
 }
 }
 
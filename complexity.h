@@ -0,0 +1,235 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_COMPLEXITY_H
+#define _EXP_PERF_COMPLEXITY_H
+
+#include "regression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// Fits the L_hat of a doubling sweep against the usual complexity models,
+// and finds the input sizes where the cost per element jumps, typically
+// because the working set no longer fits a cache level.
+//
+// For example:
+//
+// results r;
+// c.collect(1024, 12, start, stop, run, std::ref(r));
+// complexity cx(r);
+// complexity::fit f = cx.best();
+// printf("%s a=%g b=%g\n", complexity::name(f.model), f.a, f.b);
+// for (auto& j : cx.jumps()) ...
+//
+class complexity
+{
+  public:
+    enum {
+        O_1       = 0,
+        O_LOG_N   = 1,
+        O_N       = 2,
+        O_N_LOG_N = 3,
+        O_N2      = 4,
+        NUM_MODELS
+    };
+
+    // L ~ a + b * f(N), where f is the model. a takes up the fixed cost of a
+    // window, the counter itself for example, and is the only coefficient of
+    // O_1.
+    struct fit {
+        int model;
+        double a;
+        double b;
+        double rms;  // Root mean square of the relative residuals
+    };
+
+    // An input size whose cost per unit of the model, L_hat / f(N), is more
+    // than the threshold above that of the input size before it
+    struct jump {
+        int input_sz;
+        double ratio;  // Cost per unit at input_sz over the one before
+    };
+
+    complexity();
+    explicit complexity(const results& r);
+
+    void add(int input_sz, long long L_hat);
+
+    // Every model fit by weighted least squares on the relative residuals,
+    // so that the small input sizes count as much as the large ones. Sorted
+    // from the best fit to the worst, models with a negative b, which do not
+    // grow, come last with rms = INFINITY.
+    std::vector<fit> fits() const;
+
+    // The best of fits(). Among models that fit about equally well the
+    // simplest is chosen.
+    fit best() const;
+
+    // The jumps in the cost per unit of the best model, see jump.
+    std::vector<jump> jumps(double threshold = 0.25) const;
+
+    // The L a fit predicts for input_sz
+    static double predict(const fit& f, int input_sz);
+
+    // f(N) of a model
+    static double f(int model, double N);
+
+    // "O(1)", "O(log N)", ...
+    static const char* name(int model);
+
+  private:
+    fit fit_model(int model) const;
+
+    std::vector<std::pair<int, double>> m_points;  // input_sz, L_hat
+};
+
+inline complexity::complexity()
+{
+}
+
+inline complexity::complexity(const results& r)
+{
+    for (const auto& x : r.get()) {
+        add(x.first, x.second.L_hat);
+    }
+}
+
+inline void
+complexity::add(int input_sz, long long L_hat)
+{
+    m_points.emplace_back(input_sz, (double)L_hat);
+    std::sort(m_points.begin(), m_points.end());
+}
+
+inline double
+complexity::f(int model, double N)
+{
+    switch (model) {
+    case O_LOG_N:
+        return std::log2(N);
+    case O_N:
+        return N;
+    case O_N_LOG_N:
+        return N * std::log2(N);
+    case O_N2:
+        return N * N;
+    default:
+        return 1;
+    }
+}
+
+inline const char*
+complexity::name(int model)
+{
+    static const char* names[NUM_MODELS] = {
+        "O(1)", "O(log N)", "O(N)", "O(N log N)", "O(N^2)"};
+    return model >= 0 && model < NUM_MODELS ? names[model] : "?";
+}
+
+inline double
+complexity::predict(const fit& ft, int input_sz)
+{
+    return ft.model == O_1 ? ft.a : ft.a + ft.b * f(ft.model, input_sz);
+}
+
+inline complexity::fit
+complexity::fit_model(int model) const
+{
+    fit ft = {model, 0, 0, INFINITY};
+    // Minimize sum(((y - a - b x) / y)^2), i.e. least squares with weights
+    // 1 / y^2
+    double sw = 0, swx = 0, swy = 0, swxx = 0, swxy = 0;
+    for (const auto& p : m_points) {
+        if (p.second <= 0) {
+            continue;
+        }
+        const double x = f(model, p.first);
+        const double w = 1 / (p.second * p.second);
+        sw += w;
+        swx += w * x;
+        swy += w * p.second;
+        swxx += w * x * x;
+        swxy += w * x * p.second;
+    }
+    if (sw == 0) {
+        return ft;
+    }
+    if (model == O_1) {
+        ft.a = swy / sw;
+    } else {
+        const double det = sw * swxx - swx * swx;
+        if (det <= 0) {
+            return ft;
+        }
+        ft.b = (sw * swxy - swx * swy) / det;
+        ft.a = (swy - ft.b * swx) / sw;
+        if (ft.b < 0) {
+            return ft;
+        }
+    }
+
+    double ss = 0;
+    int n     = 0;
+    for (const auto& p : m_points) {
+        if (p.second > 0) {
+            const double r = (p.second - predict(ft, p.first)) / p.second;
+            ss += r * r;
+            ++n;
+        }
+    }
+    ft.rms = std::sqrt(ss / n);
+    return ft;
+}
+
+inline std::vector<complexity::fit>
+complexity::fits() const
+{
+    std::vector<fit> all;
+    for (int m = 0; m < NUM_MODELS; ++m) {
+        all.push_back(fit_model(m));
+    }
+    std::stable_sort(all.begin(), all.end(), [](const fit& x, const fit& y) {
+        return x.rms < y.rms;
+    });
+    return all;
+}
+
+inline complexity::fit
+complexity::best() const
+{
+    // Within 1% of relative error of the best, take the simplest model,
+    // since with an intercept the neighbouring models fit short sweeps alike
+    const std::vector<fit> all = fits();
+    fit b                      = all[0];
+    for (const auto& x : all) {
+        if (x.rms <= all[0].rms + 0.01 && x.model < b.model) {
+            b = x;
+        }
+    }
+    return b;
+}
+
+inline std::vector<complexity::jump>
+complexity::jumps(double threshold) const
+{
+    std::vector<jump> js;
+    const int model = best().model;
+    for (size_t i = 1; i < m_points.size(); ++i) {
+        const auto& p     = m_points[i - 1];
+        const auto& q     = m_points[i];
+        const double prev = p.second / f(model, p.first);
+        const double cur  = q.second / f(model, q.first);
+        if (prev > 0 && cur > prev * (1 + threshold)) {
+            js.push_back(jump{q.first, cur / prev});
+        }
+    }
+    return js;
+}
+}
+
+#endif  // _EXP_PERF_COMPLEXITY_H
@@ -6,8 +6,16 @@
 #include <asm/unistd.h>
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "event.h"
+#include "fixed_counts.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <system_error>
 #include <vector>
 
@@ -15,10 +23,40 @@ namespace exp_perf {
 //
 // Wraps results to a perf_event_counter syscall
 //
-class counter
+// t_counts is where the counts of a sample are kept. Use counter, which keeps
+// them in a std::vector, or fixed_counter<N>, which keeps up to N of them
+// inline so that reading a sample never goes through the heap.
+//
+template <typename t_counts>
+class basic_counter
 {
   public:
-    using counts_t = std::vector<long long>;
+    using counts_t = t_counts;
+
+    // How the group of events is stopped and read back.
+    //
+    // READ_GROUP - the leader is opened with PERF_FORMAT_GROUP |
+    // PERF_FORMAT_ID. The whole group is reset and enabled, and later
+    // disabled, with a single PERF_IOC_FLAG_GROUP ioctl each, and all counts
+    // come back from one read() of the leader, mapped back by event id. With
+    // several groups that is one ioctl and read() per group.
+    //
+    // READ_PER_FD - one reset, enable, disable and read() for every event.
+    // Events are not grouped, so groups are ignored.
+    //
+    // READ_RDPMC - like READ_GROUP, but every event also has its
+    // perf_event_mmap_page mapped. Events that advertise cap_user_rdpmc are
+    // read in userspace with rdpmc right after the group is enabled and right
+    // before it is disabled, so the syscalls fall outside the measured
+    // window. Events that can't be read this way (SW events, or a PMU that
+    // doesn't allow it) still come from the group read(). If no event is
+    // rdpmc capable, or there is more than one group and so counts may be
+    // multiplexed, the counter silently runs as READ_GROUP.
+    enum {
+        READ_PER_FD = 0,
+        READ_GROUP  = 1,
+        READ_RDPMC  = 2
+    };
 
     // Constructor is called with lists of PERF_COUNT* events
     // see linux/perf_event.h for the list
@@ -32,17 +70,59 @@ class counter
     // types that were successfully opened. For portabilityt we try to open
     // whatever is requested on every system. but not all systems support all
     // counters, especially HW/SW counters.
-    counter(std::initializer_list<int> sw_evts,
-            std::initializer_list<int> hw_evts);
+    //
+    // read_mode - one of READ_GROUP, READ_PER_FD or READ_RDPMC, see above.
+    //
+    // inherit - also count every thread and process created by the calling
+    // thread after the counter was constructed, so that the total work of
+    // code that spawns its own threads is measured. Threads that already
+    // existed, for example a pool built before the counter, are not counted.
+    // Children's counts are folded into the parent's when they exit, so join
+    // them before stop(). rdpmc can only see the calling thread, so READ_RDPMC
+    // becomes READ_GROUP, and if the kernel refuses PERF_FORMAT_GROUP
+    // together with inherit the counter falls back to READ_PER_FD.
+    basic_counter(std::initializer_list<int> sw_evts,
+                  std::initializer_list<int> hw_evts,
+                  int read_mode = READ_GROUP,
+                  bool inherit  = false);
+
+    // Constructor from arbitrary event descriptors, including PERF_TYPE_RAW
+    // and PERF_TYPE_HW_CACHE events, and events split into several groups.
+    //
+    // For example:
+    //
+    // counter c({event::hw(PERF_COUNT_HW_CPU_CYCLES),
+    //            event::hw(PERF_COUNT_HW_INSTRUCTIONS),
+    //            event::cache(PERF_COUNT_HW_CACHE_L1D,
+    //                         PERF_COUNT_HW_CACHE_OP_READ,
+    //                         PERF_COUNT_HW_CACHE_RESULT_MISS).in_group(1),
+    //            event::cache(PERF_COUNT_HW_CACHE_LL,
+    //                         PERF_COUNT_HW_CACHE_OP_READ,
+    //                         PERF_COUNT_HW_CACHE_RESULT_MISS).in_group(1)});
+    //
+    // Every count is read together with time_enabled and time_running, and
+    // scaled by their ratio over the window when the kernel had to multiplex
+    // its group, see is_unscheduled().
+    basic_counter(const std::vector<event>& evts,
+                  int read_mode = READ_GROUP,
+                  bool inherit  = false);
 
-    ~counter();
+    ~basic_counter();
 
     // Get the collected counts as a vector
     const counts_t& get_counts() const;
 
-    // Get the status of each counter
+    // Whether i is the index of an opened event in the counts vector.
+    //
+    // Events that fail to open are left out of the counts vector, so the
+    // index of an event depends on what else opened. Resolve indices with
+    // find() once after construction, they stay valid for the lifetime of
+    // the counter.
     bool get_status(int i) const;
 
+    // Whether e could be opened
+    bool get_status(const event& e) const;
+
     // Start and stop the counter, can be called many times after initialization
     void start();
     void stop();
@@ -50,9 +130,76 @@ class counter
     // get the dimension of the counts vector
     size_t get_counts_size() const;
 
+    // The read mode actually in use, which may differ from the one requested
+    // if READ_RDPMC is not available.
+    int get_read_mode() const;
+
+    // The index of e in the counts vector, or -1 if it was not requested or
+    // could not be opened. The group of e is not compared.
+    int find(const event& e) const;
+
+    // The event behind index i of the counts vector
+    const event& get_event(size_t i) const;
+
+    // The requested events that could not be opened, in the order requested
+    const std::vector<event>& get_missing() const;
+
+    // Whether event i is read in userspace with rdpmc, which is the cheapest
+    // way to read a counter
+    bool is_user_readable(size_t i) const;
+
+    // Read the running value of event i with rdpmc, without a syscall and
+    // without stopping the counter. Differences of two reads between start()
+    // and stop() count the code between them. Returns false if event i is
+    // not user readable, or not scheduled on the PMU right now.
+    bool read_user(size_t i, long long& value) const;
+
+    // Whether any group was multiplexed, and so scaled, in the last stop()
+    bool is_multiplexed() const;
+
+    // Whether any group was not on the PMU at all during the last window,
+    // which happens when it is multiplexed and the window is short. Nothing
+    // can be scaled from no time, so the counts of such a group are 0 and
+    // meaningless, and the whole sample should be discarded.
+    bool is_unscheduled() const;
+
   private:
+    // Turn the lists of the first constructor into event descriptors
+    static std::vector<event> make_events(std::initializer_list<int> sw_evts,
+                                          std::initializer_list<int> hw_evts);
+
     // Initialize an event
-    void init_event(int type, int config);
+    void init_event(const event& e);
+
+    // Scale a count its group only saw part of the time, enabled and
+    // running are those of the window
+    long long scale(uint64_t value, uint64_t enabled, uint64_t running);
+
+    // enabled and running of fd i, read as totals since it was opened, over
+    // the window since its last read. The events are disabled between
+    // windows, so their times only grow within one.
+    void window(size_t i, uint64_t& enabled, uint64_t& running);
+
+    // Start and stop strategies, see READ_PER_FD, READ_GROUP and READ_RDPMC
+    void start_per_fd();
+    void start_group();
+    void stop_per_fd();
+    void stop_group();
+    void start_rdpmc();
+    void stop_rdpmc();
+
+    // Read the current value of every event
+    void read_per_fd(counts_t& counts);
+    void read_group(counts_t& counts);
+
+    // Read the current value of an event through its mmap page, following the
+    // seqlock protocol described in linux/perf_event.h. Returns false if the
+    // event can't be read from userspace right now.
+    static bool read_rdpmc(const volatile perf_event_mmap_page* pc,
+                           long long& value);
+
+    // Map a PERF_FORMAT_ID back to its index in m_counts
+    size_t index_of(uint64_t id, size_t hint) const;
 
     // Wrapper around the syscall
     static long perf_event_open(struct perf_event_attr* hw_event,
@@ -62,44 +209,145 @@ class counter
                                 unsigned long flags);
 
     std::vector<perf_event_attr> m_events;
+    std::vector<event> m_specs;        // What each opened event was asked as
+    std::vector<event> m_missing;      // What could not be opened
     std::vector<int> m_fds;
+    std::vector<int> m_groups;         // The event::group of each leader
+    std::vector<size_t> m_leaders;     // Index of each group leader
+    std::vector<uint64_t> m_ids;       // PERF_FORMAT_ID of each event
+    std::vector<uint64_t> m_read_buf;  // Layout of a PERF_FORMAT_GROUP read
+    std::vector<perf_event_mmap_page*> m_pages;  // nullptr if not mapped
+    counts_t m_rdpmc_begin;            // Value at start() of rdpmc events
+    counts_t m_rdpmc_end;              // Value at stop() of rdpmc events
+    std::vector<char> m_rdpmc_ok;      // Whether rdpmc worked at start()
+    std::vector<uint64_t> m_enabled;   // time_enabled of the last read
+    std::vector<uint64_t> m_running;   // time_running of the last read
+    counts_t m_inherit_base;           // Value at start() for inherit
     counts_t m_counts;
+    int m_read_mode;
+    const bool m_inherit;
+    bool m_multiplexed;
+    bool m_unscheduled;
 };
 
-inline counter::counter(std::initializer_list<int> sw_evts,
-                        std::initializer_list<int> hw_evts)
+template <typename t_counts>
+basic_counter<t_counts>::basic_counter(std::initializer_list<int> sw_evts,
+                                       std::initializer_list<int> hw_evts,
+                                       int read_mode,
+                                       bool inherit)
+    : basic_counter(make_events(sw_evts, hw_evts), read_mode, inherit)
 {
+}
+
+template <typename t_counts>
+basic_counter<t_counts>::basic_counter(const std::vector<event>& evts,
+                                       int read_mode,
+                                       bool inherit)
+    : m_read_mode(inherit && read_mode == READ_RDPMC ? READ_GROUP : read_mode)
+    , m_inherit(inherit)
+    , m_multiplexed(false)
+    , m_unscheduled(false)
+{
+    for (auto& e : evts) {
+        const size_t n = m_fds.size();
+        init_event(e);
+        if (m_fds.size() == n) {
+            m_missing.push_back(e);
+        }
+    }
+    if (m_read_mode == READ_RDPMC) {
+        bool any = false;
+        for (auto pc : m_pages) {
+            any = any || (pc != nullptr && pc->cap_user_rdpmc);
+        }
+        if (!any || m_leaders.size() > 1) {
+            // Nothing to gain from the mappings, drop them
+            for (auto& pc : m_pages) {
+                if (pc != nullptr) {
+                    ::munmap(pc, sysconf(_SC_PAGESIZE));
+                    pc = nullptr;
+                }
+            }
+            m_read_mode = READ_GROUP;
+        }
+    }
+}
+
+template <typename t_counts>
+basic_counter<t_counts>::~basic_counter()
+{
+    for (auto pc : m_pages) {
+        if (pc != nullptr) {
+            ::munmap(pc, sysconf(_SC_PAGESIZE));
+        }
+    }
+    for (auto fd : m_fds) {
+        ::close(fd);
+    }
+}
+
+template <typename t_counts>
+std::vector<event>
+basic_counter<t_counts>::make_events(std::initializer_list<int> sw_evts,
+                                     std::initializer_list<int> hw_evts)
+{
+    std::vector<event> evts;
     for (auto x : sw_evts) {
-        init_event(PERF_TYPE_SOFTWARE, x);
+        evts.push_back(event::sw(x));
     }
     for (auto x : hw_evts) {
-        init_event(PERF_TYPE_HARDWARE, x);
+        evts.push_back(event::hw(x));
     }
+    return evts;
 }
 
-inline counter::~counter()
+template <typename t_counts>
+const typename basic_counter<t_counts>::counts_t&
+basic_counter<t_counts>::get_counts() const
 {
-    // we only have to close the group fd
-    ::close(m_fds[0]);
+    return m_counts;
 }
 
-inline const counter::counts_t&
-counter::get_counts() const
+template <typename t_counts>
+bool
+basic_counter<t_counts>::get_status(int i) const
 {
-    return m_counts;
+    // Only events that opened have an index
+    return i >= 0 && (size_t)i < m_fds.size();
 }
 
-inline bool
-counter::get_status(int i) const
+template <typename t_counts>
+bool
+basic_counter<t_counts>::get_status(const event& e) const
 {
-    if (i > 0 && i < m_fds.size()) {
-        return m_fds[i] > -1;
+    return find(e) >= 0;
+}
+
+template <typename t_counts>
+void
+basic_counter<t_counts>::start()
+{
+    if (m_read_mode == READ_RDPMC) {
+        start_rdpmc();
+    } else if (m_read_mode == READ_GROUP) {
+        start_group();
+    } else {
+        start_per_fd();
+    }
+    if (m_inherit) {
+        // A reset doesn't clear what exited children have already folded into
+        // the parent, so count from where we are now instead.
+        if (m_read_mode == READ_PER_FD) {
+            read_per_fd(m_inherit_base);
+        } else {
+            read_group(m_inherit_base);
+        }
     }
-    return false;
 }
 
-inline void
-counter::start()
+template <typename t_counts>
+void
+basic_counter<t_counts>::start_per_fd()
 {
     for (int i = 0; i < m_fds.size(); ++i) {
         if (m_fds[i] > -1) {
@@ -114,58 +362,403 @@ counter::start()
     }
 }
 
-inline void
-counter::stop()
+template <typename t_counts>
+void
+basic_counter<t_counts>::start_group()
+{
+    std::fill(m_counts.begin(), m_counts.end(), 0);
+    // Reset and enable every event at once so that they all count the same
+    // window.
+    for (auto l : m_leaders) {
+        if (ioctl(m_fds[l], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) < 0) {
+            throw std::system_error(errno, std::system_category());
+        }
+    }
+    for (auto l : m_leaders) {
+        if (ioctl(m_fds[l], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0) {
+            throw std::system_error(errno, std::system_category());
+        }
+    }
+}
+
+template <typename t_counts>
+void
+basic_counter<t_counts>::stop()
+{
+    if (m_read_mode == READ_RDPMC) {
+        stop_rdpmc();
+    } else if (m_read_mode == READ_GROUP) {
+        stop_group();
+    } else {
+        stop_per_fd();
+    }
+    if (m_inherit) {
+        for (size_t i = 0; i < m_counts.size(); ++i) {
+            m_counts[i] -= m_inherit_base[i];
+        }
+    }
+}
+
+template <typename t_counts>
+void
+basic_counter<t_counts>::stop_per_fd()
 {
     for (int i = 0; i < m_fds.size(); ++i) {
         if (m_fds[i] > -1) {
             if (ioctl(m_fds[i], PERF_EVENT_IOC_DISABLE, 0) < 0) {
                 throw std::system_error(errno, std::system_category());
             }
-            if (::read(m_fds[i], &m_counts[i], sizeof(long long)) < 0) {
+        }
+    }
+    read_per_fd(m_counts);
+}
+
+template <typename t_counts>
+void
+basic_counter<t_counts>::read_per_fd(counts_t& counts)
+{
+    m_multiplexed = false;
+    m_unscheduled = false;
+    for (size_t i = 0; i < m_fds.size(); ++i) {
+        if (m_fds[i] > -1) {
+            // struct read_format {
+            //     u64 value;
+            //     u64 time_enabled;
+            //     u64 time_running;
+            // };
+            uint64_t buf[3];
+            if (::read(m_fds[i], buf, sizeof(buf)) < 0) {
                 throw std::system_error(errno, std::system_category());
             }
+            window(i, buf[1], buf[2]);
+            counts[i] = scale(buf[0], buf[1], buf[2]);
         }
     }
 }
 
-inline size_t
-counter::get_counts_size() const
+template <typename t_counts>
+void
+basic_counter<t_counts>::stop_group()
+{
+    for (auto l : m_leaders) {
+        if (ioctl(m_fds[l], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP) < 0) {
+            throw std::system_error(errno, std::system_category());
+        }
+    }
+    read_group(m_counts);
+}
+
+template <typename t_counts>
+void
+basic_counter<t_counts>::read_group(counts_t& counts)
+{
+    m_multiplexed = false;
+    m_unscheduled = false;
+    for (auto l : m_leaders) {
+        // struct read_format {
+        //     u64 nr;
+        //     u64 time_enabled;
+        //     u64 time_running;
+        //     struct { u64 value; u64 id; } values[nr];
+        // };
+        if (::read(m_fds[l],
+                   m_read_buf.data(),
+                   m_read_buf.size() * sizeof(uint64_t)) < 0) {
+            throw std::system_error(errno, std::system_category());
+        }
+        const uint64_t nr = m_read_buf[0];
+        uint64_t enabled  = m_read_buf[1];
+        uint64_t running  = m_read_buf[2];
+        window(l, enabled, running);
+        for (size_t j = 0; j < nr && j < m_counts.size(); ++j) {
+            const uint64_t value = m_read_buf[3 + 2 * j];
+            const uint64_t id    = m_read_buf[4 + 2 * j];
+            counts[index_of(id, l + j)] = scale(value, enabled, running);
+        }
+    }
+}
+
+template <typename t_counts>
+long long
+basic_counter<t_counts>::scale(uint64_t value,
+                               uint64_t enabled,
+                               uint64_t running)
+{
+    if (running >= enabled) {
+        return (long long)value;
+    }
+    m_multiplexed = true;
+    if (running == 0) {
+        m_unscheduled = true;
+        return 0;
+    }
+    return std::llround((double)value * enabled / running);
+}
+
+template <typename t_counts>
+void
+basic_counter<t_counts>::window(size_t i, uint64_t& enabled, uint64_t& running)
+{
+    const uint64_t e = enabled;
+    const uint64_t r = running;
+    enabled -= m_enabled[i];
+    running -= m_running[i];
+    m_enabled[i] = e;
+    m_running[i] = r;
+}
+
+template <typename t_counts>
+void
+basic_counter<t_counts>::start_rdpmc()
+{
+    start_group();
+    // The event has to be enabled and scheduled for index to be valid, so
+    // snapshot the starting values right after the enable returns.
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        m_rdpmc_ok[i] = m_pages[i] != nullptr &&
+                        read_rdpmc(m_pages[i], m_rdpmc_begin[i]);
+    }
+}
+
+template <typename t_counts>
+void
+basic_counter<t_counts>::stop_rdpmc()
+{
+    // Take the end values first, before any syscall enters the window.
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        if (m_rdpmc_ok[i] && !read_rdpmc(m_pages[i], m_rdpmc_end[i])) {
+            m_rdpmc_ok[i] = 0;
+        }
+    }
+    stop_group();
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        if (m_rdpmc_ok[i]) {
+            m_counts[i] = m_rdpmc_end[i] - m_rdpmc_begin[i];
+        }
+    }
+}
+
+template <typename t_counts>
+bool
+basic_counter<t_counts>::read_rdpmc(const volatile perf_event_mmap_page* pc,
+                                    long long& value)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t seq;
+    uint64_t count;
+    do {
+        seq = pc->lock;
+        asm volatile("" ::: "memory");
+        const uint32_t idx = pc->index;
+        if (!pc->cap_user_rdpmc || idx == 0) {
+            return false;
+        }
+        count = pc->offset;
+
+        uint32_t lo, hi;
+        asm volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+        // Sign extend the raw counter to 64 bits before adding the offset
+        const uint16_t width = pc->pmc_width;
+        int64_t pmc          = (int64_t)(((uint64_t)hi << 32) | lo);
+        pmc                  = (int64_t)((uint64_t)pmc << (64 - width));
+        pmc >>= 64 - width;
+        count += pmc;
+
+        asm volatile("" ::: "memory");
+    } while (pc->lock != seq);
+    value = (long long)count;
+    return true;
+#else
+    (void)pc;
+    (void)value;
+    return false;
+#endif
+}
+
+template <typename t_counts>
+size_t
+basic_counter<t_counts>::index_of(uint64_t id, size_t hint) const
+{
+    // The kernel reports the leader first and then the siblings in the order
+    // they were attached, so this is almost always a hit.
+    if (hint < m_ids.size() && m_ids[hint] == id) {
+        return hint;
+    }
+    for (size_t i = 0; i < m_ids.size(); ++i) {
+        if (m_ids[i] == id) {
+            return i;
+        }
+    }
+    throw std::system_error(EINVAL, std::system_category());
+}
+
+template <typename t_counts>
+size_t
+basic_counter<t_counts>::get_counts_size() const
 {
     return m_counts.size();
 }
 
-inline void
-counter::init_event(int type, int config)
+template <typename t_counts>
+int
+basic_counter<t_counts>::get_read_mode() const
+{
+    return m_read_mode;
+}
+
+template <typename t_counts>
+int
+basic_counter<t_counts>::find(const event& e) const
+{
+    for (size_t i = 0; i < m_specs.size(); ++i) {
+        if (m_specs[i].same(e)) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+template <typename t_counts>
+const event&
+basic_counter<t_counts>::get_event(size_t i) const
+{
+    return m_specs[i];
+}
+
+template <typename t_counts>
+const std::vector<event>&
+basic_counter<t_counts>::get_missing() const
+{
+    return m_missing;
+}
+
+template <typename t_counts>
+bool
+basic_counter<t_counts>::is_user_readable(size_t i) const
+{
+    return m_read_mode == READ_RDPMC && m_pages[i] != nullptr &&
+           m_pages[i]->cap_user_rdpmc;
+}
+
+template <typename t_counts>
+bool
+basic_counter<t_counts>::read_user(size_t i, long long& value) const
+{
+    return is_user_readable(i) && read_rdpmc(m_pages[i], value);
+}
+
+template <typename t_counts>
+bool
+basic_counter<t_counts>::is_multiplexed() const
+{
+    return m_multiplexed;
+}
+
+template <typename t_counts>
+bool
+basic_counter<t_counts>::is_unscheduled() const
+{
+    return m_unscheduled;
+}
+
+template <typename t_counts>
+void
+basic_counter<t_counts>::init_event(const event& e)
 {
+    if (e.is_timer() || e.is_alloc()) {
+        // Not a perf event, see timer.h and alloc.h
+        return;
+    }
     perf_event_attr pe;
     memset(&pe, 0, sizeof(struct perf_event_attr));
 
-    pe.type           = type;
+    pe.type           = e.type;
     pe.size           = sizeof(struct perf_event_attr);
-    pe.config         = config;
-    pe.disabled       = 1;
-    pe.exclude_kernel = 1;
+    pe.config         = e.config;
+    pe.exclude_kernel = e.kernel ? 0 : 1;
     pe.exclude_hv     = 0;
+    pe.inherit        = m_inherit ? 1 : 0;
+    pe.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    if (m_read_mode != READ_PER_FD) {
+        pe.read_format |= PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+    }
 
-    const int group = m_fds.size() == 0 ? -1 : m_fds[0];
-    int fd          = perf_event_open(&pe, 0, -1, group, 0);
+    // Join the group if its leader is already open. Each event is enabled
+    // on its own in READ_PER_FD, and a sibling only runs while its leader
+    // does, so there every event leads its own group.
+    const auto g = std::find(m_groups.begin(), m_groups.end(), e.group);
+    const int group = g == m_groups.end() || m_read_mode == READ_PER_FD
+                          ? -1
+                          : m_fds[m_leaders[g - m_groups.begin()]];
+    // Only the leader is opened disabled, so that it alone gates the group.
+    // Siblings that are disabled too have to be enabled along with it, and
+    // undercount or read 0.
+    pe.disabled = group == -1 ? 1 : 0;
+    int fd = perf_event_open(&pe, 0, -1, group, 0);
+    if (fd < 0 && errno == EINVAL && m_inherit && m_fds.empty() &&
+        m_read_mode != READ_PER_FD) {
+        // Older kernels don't allow group reads of inherited events
+        m_read_mode = READ_PER_FD;
+        pe.read_format &= ~(uint64_t)(PERF_FORMAT_GROUP | PERF_FORMAT_ID);
+        fd = perf_event_open(&pe, 0, -1, group, 0);
+    }
     if (fd > -1) {
+        uint64_t id = 0;
+        if (m_read_mode != READ_PER_FD &&
+            ioctl(fd, PERF_EVENT_IOC_ID, &id) < 0) {
+            ::close(fd);
+            return;
+        }
+        perf_event_mmap_page* pc = nullptr;
+        if (m_read_mode == READ_RDPMC) {
+            void* p = ::mmap(nullptr,
+                             sysconf(_SC_PAGESIZE),
+                             PROT_READ,
+                             MAP_SHARED,
+                             fd,
+                             0);
+            if (p != MAP_FAILED) {
+                pc = static_cast<perf_event_mmap_page*>(p);
+            }
+        }
+        if (group == -1) {
+            m_groups.push_back(e.group);
+            m_leaders.push_back(m_fds.size());
+        }
         m_events.emplace_back(pe);
+        m_specs.push_back(e);
         m_fds.push_back(fd);
+        m_ids.push_back(id);
+        m_pages.push_back(pc);
+        m_rdpmc_begin.push_back(0);
+        m_rdpmc_end.push_back(0);
+        m_rdpmc_ok.push_back(0);
+        m_enabled.push_back(0);
+        m_running.push_back(0);
+        m_inherit_base.push_back(0);
         m_counts.push_back(0);
+        m_read_buf.resize(3 + 2 * m_fds.size());
     }
 }
 
-inline long
-counter::perf_event_open(struct perf_event_attr* hw_event,
-                         pid_t pid,
-                         int cpu,
-                         int group_fd,
-                         unsigned long flags)
+template <typename t_counts>
+long
+basic_counter<t_counts>::perf_event_open(struct perf_event_attr* hw_event,
+                                        pid_t pid,
+                                        int cpu,
+                                        int group_fd,
+                                        unsigned long flags)
 {
     return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
 }
+
+// The counter most code wants, counts are kept in a std::vector
+using counter = basic_counter<std::vector<long long>>;
+
+// A counter for up to t_max events with its counts kept inline
+template <size_t t_max>
+using fixed_counter = basic_counter<fixed_counts<t_max>>;
 }
 
 #endif //_EXP_PERF_COUNTER_H
@@ -0,0 +1,376 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_ENVIRONMENT_H
+#define _EXP_PERF_ENVIRONMENT_H
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// What the machine does to the samples before any are taken.
+//
+// The frequency governor, turbo, a noisy SMT sibling or interrupts on the
+// measuring CPU all widen xbar - L_hat, and with it the number of samples
+// the stopping rule asks for, or shift L itself. check_environment() reads
+// them from sysfs and procfs, so that a run can be refused before it burns
+// an hour, and to_string() records them with the results.
+//
+// For example:
+//
+// environment env = check_environment(find_quiet_cpu());
+// for (auto& w : env.warnings()) fprintf(stderr, "warning: %s\n", w.c_str());
+// pin_self(env.cpu);
+//
+struct environment {
+    int cpu;
+    std::string governor;  // scaling_governor of cpu, empty without cpufreq
+    int turbo;             // 1 if on, 0 if off, -1 if unknown
+    std::vector<int> isolated;  // /sys/devices/system/cpu/isolated
+    std::vector<int> siblings;  // The other SMT threads of cpu's core
+    double sibling_busy;        // Busiest sibling, fraction of the sample
+    double cpu_busy;            // cpu itself, not counting interrupts
+    double cpu_irq;             // Time cpu spent in hard and soft irqs
+    int perf_event_paranoid;    // INT_MIN if unknown
+
+    // Whether cpu is in isolcpus
+    bool is_isolated() const;
+
+    // What is likely to make the samples of cpu noisy, one line each, empty
+    // when nothing is
+    std::vector<std::string> warnings() const;
+
+    // One line of key=value pairs
+    std::string to_string() const;
+
+    // The same as a JSON object
+    std::string to_json() const;
+};
+
+// Check cpu, or the CPU the calling thread runs on if cpu < 0. The busy
+// fractions are measured over sample_ms.
+environment check_environment(int cpu = -1, int sample_ms = 100);
+
+// The quietest CPU the calling thread may run on: isolated ones first, then
+// the one whose own and siblings' load, measured over sample_ms, is
+// lowest. isolcpus are usually left out of the default affinity mask, so
+// isolated CPUs outside of it are considered too if the thread can be
+// pinned to them, which is tried and then undone. -1 if the affinity mask
+// can't be read.
+int find_quiet_cpu(int sample_ms = 100);
+
+namespace environment_detail
+{
+// The first line of a file, without the newline, or "" if it can't be read
+inline std::string
+read_line(const std::string& path)
+{
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == nullptr) {
+        return std::string();
+    }
+    char buf[4096] = {0};
+    const bool ok  = fgets(buf, sizeof(buf), f) != nullptr;
+    fclose(f);
+    if (!ok) {
+        return std::string();
+    }
+    buf[strcspn(buf, "\n")] = 0;
+    return buf;
+}
+
+// A cpu list like "0-3,8,10-11"
+inline std::vector<int>
+parse_list(const std::string& s)
+{
+    std::vector<int> cpus;
+    const char* p = s.c_str();
+    while (*p != 0) {
+        char* end   = nullptr;
+        const int a = (int)strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        int b = a;
+        if (*end == '-') {
+            p = end + 1;
+            b = (int)strtol(p, &end, 10);
+        }
+        for (int c = a; c <= b; ++c) {
+            cpus.push_back(c);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
+
+// Per cpu busy, irq and total jiffies from /proc/stat
+struct cpu_times {
+    unsigned long long busy;
+    unsigned long long irq;
+    unsigned long long total;
+};
+
+inline std::vector<cpu_times>
+read_times()
+{
+    std::vector<cpu_times> times;
+    FILE* f = fopen("/proc/stat", "r");
+    if (f == nullptr) {
+        return times;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        // cpuN user nice system idle iowait irq softirq steal ...
+        int cpu;
+        unsigned long long v[8] = {0};
+        if (strncmp(line, "cpu", 3) != 0 || line[3] < '0' || line[3] > '9') {
+            // Not a cpu, or the sum over all of them
+            continue;
+        }
+        if (sscanf(line,
+                   "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu",
+                   &cpu,
+                   &v[0],
+                   &v[1],
+                   &v[2],
+                   &v[3],
+                   &v[4],
+                   &v[5],
+                   &v[6],
+                   &v[7]) < 8) {
+            continue;
+        }
+        if ((int)times.size() <= cpu) {
+            times.resize(cpu + 1, cpu_times{0, 0, 0});
+        }
+        cpu_times& t = times[cpu];
+        t.irq        = v[5] + v[6];
+        t.busy       = v[0] + v[1] + v[2] + v[7];
+        t.total      = t.busy + t.irq + v[3] + v[4];
+    }
+    fclose(f);
+    return times;
+}
+
+// The fraction of [a, b] cpu was busy, or in irqs with irq
+inline double
+share(const std::vector<cpu_times>& a,
+      const std::vector<cpu_times>& b,
+      int cpu,
+      bool irq = false)
+{
+    if (cpu < 0 || (size_t)cpu >= a.size() || (size_t)cpu >= b.size()) {
+        return 0;
+    }
+    const double total = (double)(b[cpu].total - a[cpu].total);
+    const double x     = irq ? (double)(b[cpu].irq - a[cpu].irq)
+                             : (double)(b[cpu].busy - a[cpu].busy);
+    return total > 0 ? x / total : 0;
+}
+
+inline std::vector<int>
+siblings_of(int cpu)
+{
+    std::vector<int> s = parse_list(
+        read_line("/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                  "/topology/thread_siblings_list"));
+    s.erase(std::remove(s.begin(), s.end(), cpu), s.end());
+    return s;
+}
+
+inline std::string
+join(const std::vector<int>& cpus)
+{
+    std::string s;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        s += (i > 0 ? "," : "") + std::to_string(cpus[i]);
+    }
+    return s;
+}
+}
+
+inline bool
+environment::is_isolated() const
+{
+    return std::find(isolated.begin(), isolated.end(), cpu) != isolated.end();
+}
+
+inline std::vector<std::string>
+environment::warnings() const
+{
+    std::vector<std::string> w;
+    const std::string c = "cpu " + std::to_string(cpu);
+    if (!governor.empty() && governor != "performance") {
+        w.push_back(c + " has the " + governor +
+                    " governor, its frequency varies");
+    }
+    if (turbo == 1) {
+        w.push_back("turbo is on, the frequency depends on load and heat");
+    }
+    if (!is_isolated()) {
+        w.push_back(c + " is not in isolcpus");
+    }
+    if (sibling_busy > 0.05) {
+        w.push_back(c + " shares its core with a sibling that is " +
+                    std::to_string((int)(100 * sibling_busy)) + "% busy");
+    }
+    if (cpu_busy > 0.05) {
+        w.push_back(c + " is " + std::to_string((int)(100 * cpu_busy)) +
+                    "% busy with other work");
+    }
+    if (cpu_irq > 0.01) {
+        w.push_back(c + " spends " + std::to_string((int)(100 * cpu_irq)) +
+                    "% of its time in interrupts");
+    }
+    if (perf_event_paranoid > 2) {
+        w.push_back("perf_event_paranoid is " +
+                    std::to_string(perf_event_paranoid) +
+                    ", only the timer backends are available");
+    }
+    return w;
+}
+
+inline std::string
+environment::to_string() const
+{
+    char buf[256];
+    snprintf(buf,
+             sizeof(buf),
+             " turbo=%d isolated=%d sibling_busy=%.3f cpu_busy=%.3f "
+             "cpu_irq=%.3f paranoid=%d",
+             turbo,
+             is_isolated() ? 1 : 0,
+             sibling_busy,
+             cpu_busy,
+             cpu_irq,
+             perf_event_paranoid);
+    return "cpu=" + std::to_string(cpu) +
+           " governor=" + (governor.empty() ? "none" : governor) +
+           " siblings=" + environment_detail::join(siblings) + buf;
+}
+
+inline std::string
+environment::to_json() const
+{
+    char buf[256];
+    snprintf(buf,
+             sizeof(buf),
+             ",\"turbo\":%d,\"isolated\":%s,\"sibling_busy\":%.3f,"
+             "\"cpu_busy\":%.3f,\"cpu_irq\":%.3f,\"paranoid\":%d}",
+             turbo,
+             is_isolated() ? "true" : "false",
+             sibling_busy,
+             cpu_busy,
+             cpu_irq,
+             perf_event_paranoid);
+    // Governors are identifiers, so they need no escaping
+    return "{\"cpu\":" + std::to_string(cpu) + ",\"governor\":\"" + governor +
+           "\",\"siblings\":[" + environment_detail::join(siblings) + "]" +
+           buf;
+}
+
+inline environment
+check_environment(int cpu, int sample_ms)
+{
+    namespace d = environment_detail;
+    environment env;
+    env.cpu = cpu >= 0 ? cpu : sched_getcpu();
+
+    const std::string sys = "/sys/devices/system/cpu/";
+    const std::string dir = sys + "cpu" + std::to_string(env.cpu) + "/";
+
+    env.governor = d::read_line(dir + "cpufreq/scaling_governor");
+    const std::string no_turbo = d::read_line(sys + "intel_pstate/no_turbo");
+    const std::string boost    = d::read_line(sys + "cpufreq/boost");
+    env.turbo = !no_turbo.empty() ? (no_turbo == "0" ? 1 : 0)
+                : !boost.empty()  ? (boost == "1" ? 1 : 0)
+                                  : -1;
+    env.isolated = d::parse_list(d::read_line(sys + "isolated"));
+    env.siblings = d::siblings_of(env.cpu);
+
+    const std::string paranoid =
+        d::read_line("/proc/sys/kernel/perf_event_paranoid");
+    env.perf_event_paranoid =
+        paranoid.empty() ? INT_MIN : (int)strtol(paranoid.c_str(), nullptr, 10);
+
+    const std::vector<d::cpu_times> t0 = d::read_times();
+    usleep(sample_ms * 1000);
+    const std::vector<d::cpu_times> t1 = d::read_times();
+
+    env.sibling_busy = 0;
+    for (int s : env.siblings) {
+        env.sibling_busy = std::max(env.sibling_busy, d::share(t0, t1, s));
+    }
+    // We are asleep, so whatever ran on cpu was someone else
+    env.cpu_busy = d::share(t0, t1, env.cpu);
+    env.cpu_irq  = d::share(t0, t1, env.cpu, true);
+    return env;
+}
+
+inline int
+find_quiet_cpu(int sample_ms)
+{
+    namespace d = environment_detail;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return -1;
+    }
+    const std::vector<int> isolated =
+        d::parse_list(d::read_line("/sys/devices/system/cpu/isolated"));
+    // Within our cpuset the mask can be widened, see pin_self()
+    cpu_set_t allowed = set;
+    bool probed       = false;
+    for (int c : isolated) {
+        if (c < 0 || c >= CPU_SETSIZE || CPU_ISSET(c, &set)) {
+            continue;
+        }
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(c, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) == 0) {
+            CPU_SET(c, &allowed);
+        }
+        probed = true;
+    }
+    if (probed) {
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    const std::vector<d::cpu_times> t0 = d::read_times();
+    usleep(sample_ms * 1000);
+    const std::vector<d::cpu_times> t1 = d::read_times();
+
+    int best          = -1;
+    double best_score = 0;
+    for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (!CPU_ISSET(c, &allowed)) {
+            continue;
+        }
+        double score = d::share(t0, t1, c) + d::share(t0, t1, c, true);
+        for (int s : d::siblings_of(c)) {
+            score += d::share(t0, t1, s);
+        }
+        // Any isolated CPU beats any other
+        if (std::find(isolated.begin(), isolated.end(), c) == isolated.end()) {
+            score += 100;
+        }
+        if (best < 0 || score < best_score) {
+            best       = c;
+            best_score = score;
+        }
+    }
+    return best;
+}
+}
+
+#endif  // _EXP_PERF_ENVIRONMENT_H
@@ -0,0 +1,177 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_ESTIMATOR_H
+#define _EXP_PERF_ESTIMATOR_H
+
+#include <algorithm>
+#include <cmath>
+
+namespace exp_perf
+{
+//
+// Running estimate of a shifted exponential E = l exp(-l(x-L)) together with
+// the stopping rule used by the collectors.
+//
+// Samples are fed in with add(), and every so often update() recomputes
+//
+//   L_hat   = min(X_i)
+//   lam_hat = 1 / (xbar - L_hat)
+//   beta    = -log(alpha) / (n_tot * lam_hat * L_hat)
+//
+// and says whether beta has dropped below beta_min. See collector for the
+// meaning of the parameters.
+//
+class estimator
+{
+  public:
+    estimator(double alpha, double beta_min, int min_incr, int max_incr);
+
+    // Add one sample. cnt is the count of a window that covered batch calls
+    // of the function under test, see collector::set_batch().
+    void add(long long cnt, int batch = 1);
+
+    // Recompute lam_hat and beta from the samples added so far. Returns true
+    // once beta <= beta_min.
+    bool update();
+
+    // How many more samples to gather before the next update()
+    int get_next_n() const;
+
+    double get_sum() const;
+    long long get_L_hat() const;
+    int get_n_tot() const;
+    double get_lam_hat() const;
+    double get_beta() const;
+
+  private:
+    double m_log_alpha;
+    double m_beta_min;
+    int m_min_incr;
+    int m_max_incr;
+    double m_sum;
+    double m_min;  // Smallest per-call sample
+    int m_n_tot;
+    double m_lam_hat;
+    double m_beta;
+    int m_next_n;
+};
+
+inline estimator::estimator(double alpha,
+                            double beta_min,
+                            int min_incr,
+                            int max_incr)
+    : m_log_alpha(std::log(alpha))
+    , m_beta_min(beta_min)
+    , m_min_incr(min_incr)
+    , m_max_incr(max_incr)
+    , m_sum(0)
+    , m_min(0)
+    , m_n_tot(0)
+    , m_lam_hat(0)
+    , m_beta(beta_min + 1)
+    , m_next_n(min_incr)
+{
+}
+
+inline void
+estimator::add(long long cnt, int batch)
+{
+    const double x = (double)cnt / batch;
+    m_sum += x;
+    if (m_n_tot == 0 || x < m_min) {
+        m_min = x;
+    }
+    ++m_n_tot;
+}
+
+inline bool
+estimator::update()
+{
+    if (m_n_tot == 0) {
+        return false;
+    }
+    // Unrounded, so that batched samples don't put L_hat above xbar
+    const double L_hat = m_min;
+
+    // Calculate the beta estimate
+    const double xbar = m_sum / m_n_tot;
+    if (xbar <= L_hat) {
+        // Every sample was the minimum, there is nothing left to learn
+        m_lam_hat = INFINITY;
+        m_beta    = 0;
+        return true;
+    }
+    m_lam_hat = 1. / (xbar - L_hat);
+    if (L_hat <= 0) {
+        // beta is relative to L_hat, and so unbounded. Events whose fastest
+        // window counts nothing, like page faults, keep gathering min_incr.
+        m_beta   = INFINITY;
+        m_next_n = m_min_incr;
+        return false;
+    }
+    double fac = m_n_tot * m_lam_hat * L_hat;
+    m_beta     = -m_log_alpha / fac;
+    if (m_beta <= m_beta_min) {
+        return true;
+    }
+
+    // To get the new N, estimate what n should be based off the beta we
+    // calculated and use this as a guide to see how many more we should
+    // gather. Clamp it before the cast, a tiny L_hat overflows an int.
+    fac             = m_lam_hat * m_beta_min * L_hat;
+    const int new_n = (int)std::min(-m_log_alpha / fac,
+                                    (double)m_n_tot + m_max_incr);
+    if (new_n < m_n_tot) {
+        // Our forumlas don't work anymore, gather min_incr until
+        // something good happens, or we exceed the loop_cnt
+        m_next_n = m_min_incr;
+    } else {
+        // Only gather a clamped number of samples.
+        m_next_n = new_n - m_n_tot;
+        if (m_next_n > m_max_incr) {
+            m_next_n = m_max_incr;
+        } else if (m_next_n < m_min_incr) {
+            m_next_n = m_min_incr;
+        }
+    }
+    return false;
+}
+
+inline int
+estimator::get_next_n() const
+{
+    return m_next_n;
+}
+
+inline double
+estimator::get_sum() const
+{
+    return m_sum;
+}
+
+inline long long
+estimator::get_L_hat() const
+{
+    return std::llround(m_min);
+}
+
+inline int
+estimator::get_n_tot() const
+{
+    return m_n_tot;
+}
+
+inline double
+estimator::get_lam_hat() const
+{
+    return m_lam_hat;
+}
+
+inline double
+estimator::get_beta() const
+{
+    return m_beta;
+}
+}
+
+#endif  // _EXP_PERF_ESTIMATOR_H
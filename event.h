@@ -0,0 +1,245 @@
+// Copyright (C) 2016 by Soren Telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_EVENT_H
+#define _EXP_PERF_EVENT_H
+
+#include <linux/perf_event.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace exp_perf {
+//
+// Describes one event for counter to open, see perf_event_open(2) for the
+// meaning of type and config.
+//
+// For example:
+//
+// event::hw(PERF_COUNT_HW_INSTRUCTIONS)
+// event::cache(PERF_COUNT_HW_CACHE_LL,
+//              PERF_COUNT_HW_CACHE_OP_READ,
+//              PERF_COUNT_HW_CACHE_RESULT_MISS)
+// event::raw(0x01c2)  // uops_retired.all on some Intel cores
+//
+// Events with the same group are always scheduled on the PMU together, so
+// ratios between them are exact. Different groups are time multiplexed by the
+// kernel when there are more events than counters, and their counts are
+// scaled by time_enabled / time_running.
+//
+// Events count in user mode only, unless kernel is set. The scheduler
+// events, context switches and CPU migrations, only ever happen in the
+// kernel, so sw() sets it for them.
+//
+struct event {
+    // Pseudo types which are not perf events, and that counter can't open.
+    // collector measures the timers with the backends of timer.h instead,
+    // and the allocations with the hooks of alloc.h.
+    static const uint32_t TYPE_TSC         = 0xffffff00;
+    static const uint32_t TYPE_CLOCK       = 0xffffff01;
+    static const uint32_t TYPE_ALLOC_CALLS = 0xffffff02;
+    static const uint32_t TYPE_ALLOC_BYTES = 0xffffff03;
+
+    uint32_t type;    // PERF_TYPE_*
+    uint64_t config;  // Meaning depends on type
+    int group;        // Events in the same group are scheduled together
+    bool kernel;      // Also count in kernel mode
+
+    // PERF_TYPE_SOFTWARE, config is a PERF_COUNT_SW_*
+    static event sw(uint64_t config);
+
+    // PERF_TYPE_HARDWARE, config is a PERF_COUNT_HW_*
+    static event hw(uint64_t config);
+
+    // PERF_TYPE_HW_CACHE, from a PERF_COUNT_HW_CACHE_* id, op and result
+    static event cache(int id, int op, int result);
+
+    // PERF_TYPE_RAW, code is the model specific event code
+    static event raw(uint64_t code);
+
+    // The time stamp counter, see tsc_timer
+    static event tsc();
+
+    // CLOCK_MONOTONIC_RAW, see clock_timer
+    static event clock();
+
+    // Allocations made by the calling thread, see alloc.h
+    static event alloc_calls();
+
+    // Bytes allocated by the calling thread, see alloc.h
+    static event alloc_bytes();
+
+    // Whether this is the tsc() or clock() pseudo event
+    bool is_timer() const;
+
+    // Whether this is the alloc_calls() or alloc_bytes() pseudo event
+    bool is_alloc() const;
+
+    // A copy of this event scheduled in group g
+    event in_group(int g) const;
+
+    // A copy of this event that counts in kernel mode too, or not
+    event with_kernel(bool k = true) const;
+
+    // Whether both describe the same event, regardless of the group
+    bool same(const event& e) const;
+
+    // The name perf(1) uses, like "instructions" or "task-clock", "tsc" and
+    // "clock" for the timers, or the type and config for anything else, like
+    // "raw:0x1c2"
+    std::string name() const;
+};
+
+inline event
+event::sw(uint64_t config)
+{
+    const bool kernel = config == PERF_COUNT_SW_CONTEXT_SWITCHES ||
+                        config == PERF_COUNT_SW_CPU_MIGRATIONS;
+    return event{PERF_TYPE_SOFTWARE, config, 0, kernel};
+}
+
+inline event
+event::hw(uint64_t config)
+{
+    return event{PERF_TYPE_HARDWARE, config, 0, false};
+}
+
+inline event
+event::cache(int id, int op, int result)
+{
+    return event{PERF_TYPE_HW_CACHE,
+                 (uint64_t)id | ((uint64_t)op << 8) | ((uint64_t)result << 16),
+                 0,
+                 false};
+}
+
+inline event
+event::raw(uint64_t code)
+{
+    return event{PERF_TYPE_RAW, code, 0, false};
+}
+
+inline event
+event::tsc()
+{
+    return event{TYPE_TSC, 0, 0, false};
+}
+
+inline event
+event::clock()
+{
+    return event{TYPE_CLOCK, 0, 0, false};
+}
+
+inline event
+event::alloc_calls()
+{
+    return event{TYPE_ALLOC_CALLS, 0, 0, false};
+}
+
+inline event
+event::alloc_bytes()
+{
+    return event{TYPE_ALLOC_BYTES, 0, 0, false};
+}
+
+inline bool
+event::is_timer() const
+{
+    return type == TYPE_TSC || type == TYPE_CLOCK;
+}
+
+inline bool
+event::is_alloc() const
+{
+    return type == TYPE_ALLOC_CALLS || type == TYPE_ALLOC_BYTES;
+}
+
+inline event
+event::in_group(int g) const
+{
+    return event{type, config, g, kernel};
+}
+
+inline event
+event::with_kernel(bool k) const
+{
+    return event{type, config, group, k};
+}
+
+inline bool
+event::same(const event& e) const
+{
+    return type == e.type && config == e.config;
+}
+
+inline std::string
+event::name() const
+{
+    static const char* hw_names[] = {"cycles",
+                                     "instructions",
+                                     "cache-references",
+                                     "cache-misses",
+                                     "branches",
+                                     "branch-misses",
+                                     "bus-cycles",
+                                     "stalled-cycles-frontend",
+                                     "stalled-cycles-backend",
+                                     "ref-cycles"};
+    static const char* sw_names[] = {"cpu-clock",
+                                     "task-clock",
+                                     "page-faults",
+                                     "context-switches",
+                                     "cpu-migrations",
+                                     "minor-faults",
+                                     "major-faults",
+                                     "alignment-faults",
+                                     "emulation-faults"};
+    const size_t n_hw = sizeof(hw_names) / sizeof(hw_names[0]);
+    const size_t n_sw = sizeof(sw_names) / sizeof(sw_names[0]);
+    switch (type) {
+    case TYPE_TSC:
+        return "tsc";
+    case TYPE_CLOCK:
+        return "clock";
+    case TYPE_ALLOC_CALLS:
+        return "alloc-calls";
+    case TYPE_ALLOC_BYTES:
+        return "alloc-bytes";
+    case PERF_TYPE_HARDWARE:
+        if (config < n_hw) {
+            return hw_names[config];
+        }
+        break;
+    case PERF_TYPE_SOFTWARE:
+        if (config < n_sw) {
+            return sw_names[config];
+        }
+        break;
+    default:
+        break;
+    }
+    const char* prefix = type == PERF_TYPE_HARDWARE   ? "hw"
+                         : type == PERF_TYPE_SOFTWARE ? "sw"
+                         : type == PERF_TYPE_HW_CACHE ? "cache"
+                         : type == PERF_TYPE_RAW      ? "raw"
+                                                      : nullptr;
+    char buf[64];
+    if (prefix != nullptr) {
+        snprintf(buf,
+                 sizeof(buf),
+                 "%s:0x%llx",
+                 prefix,
+                 (unsigned long long)config);
+    } else {
+        snprintf(buf,
+                 sizeof(buf),
+                 "%u:0x%llx",
+                 type,
+                 (unsigned long long)config);
+    }
+    return buf;
+}
+}
+
+#endif  // _EXP_PERF_EVENT_H
@@ -0,0 +1,118 @@
+// Copyright (C) 2016 by Soren Telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_FIXED_COUNTS_H
+#define _EXP_PERF_FIXED_COUNTS_H
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <system_error>
+
+namespace exp_perf {
+//
+// Inline, fixed capacity storage for the counts of a counter, so that the
+// result of every sample lives inside the counter instead of on the heap.
+//
+// Provides the part of the std::vector interface counter and collector use.
+// Growing past t_max throws.
+//
+template <size_t t_max>
+class fixed_counts
+{
+  public:
+    using value_type     = long long;
+    using iterator       = long long*;
+    using const_iterator = const long long*;
+
+    fixed_counts();
+
+    void push_back(long long x);
+    size_t size() const;
+    bool empty() const;
+
+    long long& operator[](size_t i);
+    const long long& operator[](size_t i) const;
+
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+
+  private:
+    std::array<long long, t_max> m_data;
+    size_t m_size;
+};
+
+template <size_t t_max>
+fixed_counts<t_max>::fixed_counts()
+    : m_data()
+    , m_size(0)
+{
+}
+
+template <size_t t_max>
+void
+fixed_counts<t_max>::push_back(long long x)
+{
+    if (m_size == t_max) {
+        throw std::system_error(E2BIG, std::system_category());
+    }
+    m_data[m_size++] = x;
+}
+
+template <size_t t_max>
+size_t
+fixed_counts<t_max>::size() const
+{
+    return m_size;
+}
+
+template <size_t t_max>
+bool
+fixed_counts<t_max>::empty() const
+{
+    return m_size == 0;
+}
+
+template <size_t t_max>
+long long& fixed_counts<t_max>::operator[](size_t i)
+{
+    return m_data[i];
+}
+
+template <size_t t_max>
+const long long& fixed_counts<t_max>::operator[](size_t i) const
+{
+    return m_data[i];
+}
+
+template <size_t t_max>
+typename fixed_counts<t_max>::iterator
+fixed_counts<t_max>::begin()
+{
+    return m_data.data();
+}
+
+template <size_t t_max>
+typename fixed_counts<t_max>::iterator
+fixed_counts<t_max>::end()
+{
+    return m_data.data() + m_size;
+}
+
+template <size_t t_max>
+typename fixed_counts<t_max>::const_iterator
+fixed_counts<t_max>::begin() const
+{
+    return m_data.data();
+}
+
+template <size_t t_max>
+typename fixed_counts<t_max>::const_iterator
+fixed_counts<t_max>::end() const
+{
+    return m_data.data() + m_size;
+}
+}
+
+#endif  // _EXP_PERF_FIXED_COUNTS_H
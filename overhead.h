@@ -0,0 +1,204 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_OVERHEAD_H
+#define _EXP_PERF_OVERHEAD_H
+
+#include "counter.h"
+#include "event.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// What measuring costs: the counts of an empty window.
+//
+// Every sample includes the part of start() and stop() that falls inside
+// the window, so no L_hat can be lower than this floor. It depends on how
+// the counter is read and grows with the number of events open, and on the
+// timer backends it is the cost of reading the timer twice.
+// measure_overheads() measures it for each of them, see runner's --overhead
+// for a stable report, and collector::set_subtract_floor() takes it off
+// L_hat.
+//
+// For example:
+//
+// for (const auto& o : measure_overheads()) {
+//     printf("%s %d %lld\n", o.backend.c_str(), o.events, o.floor);
+// }
+//
+struct overhead {
+    std::string backend;  // "per-fd", "group", "rdpmc", "tsc" or "clock"
+    int events;           // The number of events open
+    event target;         // What floor and mean count
+    long long floor;      // The smallest count of an empty window
+    double mean;          // The average count of an empty window
+    int n;                // The number of windows
+};
+
+// The floor of target read with read_mode, see counter::READ_PER_FD, with
+// events - 1 more events of the same type opened alongside it. Returns
+// false if target can't be opened, or read_mode is READ_RDPMC and the
+// counter had to fall back to READ_GROUP, or the events never got on the
+// PMU together. Windows they missed are left out of n.
+bool measure_overhead(const event& target,
+                      int read_mode,
+                      int events,
+                      int samples,
+                      overhead& o);
+
+// The floor of one of the timers of timer.h, false if it isn't available
+template <typename t_timer>
+bool measure_timer_overhead(int samples, overhead& o);
+
+// The floors of every read mode with 1, 2, 4 ... max_events events, for
+// each of instructions, cycles and task-clock that can be opened, then the
+// TSC and the clock
+std::vector<overhead> measure_overheads(int max_events = 8,
+                                        int samples    = 10000);
+
+namespace overhead_detail
+{
+// events - 1 events of the type of target other than target, to pad the
+// counter with
+inline std::vector<event>
+padding(const event& target, int events)
+{
+    static const uint64_t hw[] = {PERF_COUNT_HW_INSTRUCTIONS,
+                                  PERF_COUNT_HW_CPU_CYCLES,
+                                  PERF_COUNT_HW_REF_CPU_CYCLES,
+                                  PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+                                  PERF_COUNT_HW_BRANCH_MISSES,
+                                  PERF_COUNT_HW_CACHE_REFERENCES,
+                                  PERF_COUNT_HW_CACHE_MISSES,
+                                  PERF_COUNT_HW_BUS_CYCLES};
+    static const uint64_t sw[] = {PERF_COUNT_SW_TASK_CLOCK,
+                                  PERF_COUNT_SW_CPU_CLOCK,
+                                  PERF_COUNT_SW_PAGE_FAULTS,
+                                  PERF_COUNT_SW_PAGE_FAULTS_MIN,
+                                  PERF_COUNT_SW_PAGE_FAULTS_MAJ,
+                                  PERF_COUNT_SW_CONTEXT_SWITCHES,
+                                  PERF_COUNT_SW_CPU_MIGRATIONS,
+                                  PERF_COUNT_SW_ALIGNMENT_FAULTS};
+    const bool is_hw      = target.type == PERF_TYPE_HARDWARE;
+    const uint64_t* other = is_hw ? hw : sw;
+    std::vector<event> evts;
+    for (size_t i = 0; i < 8 && (int)evts.size() < events - 1; ++i) {
+        const event e = is_hw ? event::hw(other[i]) : event::sw(other[i]);
+        if (!e.same(target)) {
+            evts.push_back(e);
+        }
+    }
+    return evts;
+}
+}
+
+inline bool
+measure_overhead(const event& target,
+                 int read_mode,
+                 int events,
+                 int samples,
+                 overhead& o)
+{
+    std::vector<event> evts = overhead_detail::padding(target, events);
+    evts.insert(evts.begin(), target);
+
+    fixed_counter<16> c(evts, read_mode);
+    const int idx = c.find(target);
+    if (idx < 0 || c.get_read_mode() != read_mode) {
+        return false;
+    }
+    long long floor = 0;
+    double sum      = 0;
+    int n           = 0;
+    for (int i = 0; i < samples; ++i) {
+        c.start();
+        c.stop();
+        if (c.is_unscheduled()) {
+            // The group didn't get on the PMU, there is no count
+            continue;
+        }
+        const long long x = c.get_counts()[idx];
+        floor             = n == 0 ? x : std::min(floor, x);
+        sum += x;
+        ++n;
+    }
+    if (n == 0) {
+        return false;
+    }
+    static const char* names[] = {"per-fd", "group", "rdpmc"};
+    o = overhead{names[read_mode],
+                 (int)c.get_counts_size(),
+                 target,
+                 floor,
+                 sum / n,
+                 n};
+    return true;
+}
+
+template <typename t_timer>
+bool
+measure_timer_overhead(int samples, overhead& o)
+{
+    if (!t_timer::available()) {
+        return false;
+    }
+    long long floor = 0;
+    double sum      = 0;
+    for (int i = 0; i < samples; ++i) {
+        const long long t0 = t_timer::begin();
+        const long long t1 = t_timer::end();
+        floor              = i == 0 ? t1 - t0 : std::min(floor, t1 - t0);
+        sum += t1 - t0;
+    }
+    const bool tsc = std::is_same<t_timer, tsc_timer>::value;
+
+    o = overhead{tsc ? "tsc" : "clock",
+                 1,
+                 tsc ? event::tsc() : event::clock(),
+                 floor,
+                 samples > 0 ? sum / samples : 0,
+                 samples};
+    return true;
+}
+
+inline std::vector<overhead>
+measure_overheads(int max_events, int samples)
+{
+    const event targets[] = {event::hw(PERF_COUNT_HW_INSTRUCTIONS),
+                             event::hw(PERF_COUNT_HW_CPU_CYCLES),
+                             event::sw(PERF_COUNT_SW_TASK_CLOCK)};
+    const int modes[]     = {counter::READ_PER_FD,
+                             counter::READ_GROUP,
+                             counter::READ_RDPMC};
+    std::vector<overhead> result;
+    overhead o;
+    for (const event& t : targets) {
+        for (int mode : modes) {
+            for (int k = 1; k <= max_events; k *= 2) {
+                // Fewer events may open than asked for, don't report a size
+                // twice
+                if (measure_overhead(t, mode, k, samples, o) &&
+                    (result.empty() || result.back().events != o.events ||
+                     result.back().backend != o.backend ||
+                     !result.back().target.same(t))) {
+                    result.push_back(o);
+                }
+            }
+        }
+    }
+    if (measure_timer_overhead<tsc_timer>(samples, o)) {
+        result.push_back(o);
+    }
+    if (measure_timer_overhead<clock_timer>(samples, o)) {
+        result.push_back(o);
+    }
+    return result;
+}
+}
+
+#endif  // _EXP_PERF_OVERHEAD_H
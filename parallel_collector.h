@@ -0,0 +1,421 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_PARALLEL_COLLECTOR_H
+#define _EXP_PERF_PARALLEL_COLLECTOR_H
+
+#include "affinity.h"
+#include "counter.h"
+#include "estimator.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <exception>
+#include <memory>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// The multithreaded version of collector, for measuring how concurrent code
+// scales.
+//
+// One worker thread is started per entry of cpus and pinned to it. Each
+// worker owns its own counter group, since perf counters opened with pid=0
+// only follow the thread that opened them. For every sample all workers are
+// released from a barrier together, run run(N, thread_id) between their own
+// counter start/stop, and meet again at a second barrier.
+//
+// The stopping rule of collector is applied to the aggregate count of a
+// sample, that is the total work summed over all threads. Every thread's
+// counts are also tracked on their own so the updater can see the per-thread
+// L_hat.
+//
+// The calling thread waits on the barriers too, so keep one CPU outside of
+// cpus for it.
+//
+class parallel_collector
+{
+  public:
+    // Constructor.
+    //
+    // alpha, beta_min, min_incr, max_incr, max_rounds and n_init are the same
+    // as for collector.
+    //
+    // cpus - the CPU each worker is pinned to, its size is the number of
+    // threads.
+    parallel_collector(double alpha,
+                       double beta_min,
+                       int min_incr,
+                       int max_incr,
+                       int max_rounds,
+                       int n_init,
+                       std::vector<int> cpus);
+
+    // The main user entry point.
+    //
+    // init_input_sz - the starting value of the input size
+    // num_run - the number of runs to make, each time doubling init_input_sz
+    // start - run once before every sample on the calling thread, not timed
+    // stop - run once after every sample on the calling thread, not timed
+    // run - the function under test, called as run(N, thread_id) on every
+    //   worker
+    // u - an updater, called as
+    //
+    //   u(input_sz, sum, L_hat, n_tot, per_thread)
+    //
+    //   where the first four are the aggregate results as for collector, and
+    //   per_thread is a std::vector<estimator> holding the results of each
+    //   thread.
+    template <typename t_start,
+              typename t_stop,
+              typename t_run,
+              typename t_updater>
+    void collect(int init_input_sz,
+                 int num_runs,
+                 t_start start,
+                 t_stop stop,
+                 t_run run,
+                 t_updater u);
+
+    // The number of worker threads
+    size_t get_num_threads() const;
+
+  private:
+    // A generation counting barrier that spins, so that released workers
+    // start their windows as close together as possible.
+    class spin_barrier
+    {
+      public:
+        explicit spin_barrier(int n);
+
+        // Arrive and wait for the other n - 1
+        void wait();
+
+        // Arrive without waiting, returns true if this completed the phase
+        bool arrive();
+
+      private:
+        const int m_n;
+        std::atomic<int> m_waiting;
+        std::atomic<unsigned> m_gen;
+    };
+
+    // What each worker hands back, a cache line each so that the workers
+    // don't share one while writing it.
+    struct alignas(64) slot {
+        long long cnt;
+        int instr_idx;  // Index of instructions in this worker's counter
+        int task_idx;   // Index of task-clock in this worker's counter
+        std::exception_ptr error;
+    };
+
+    // Destroys and frees what make_slots() allocated
+    struct slots_deleter {
+        size_t n;
+        void operator()(slot* s) const;
+    };
+
+    // n slots, aligned to a cache line, which new only guarantees for
+    // alignof(max_align_t) before C++17
+    static std::unique_ptr<slot[], slots_deleter> make_slots(size_t n);
+
+    // The body of each worker thread
+    template <typename t_run>
+    void worker(int tid, t_run& run);
+
+    // One barrier-synchronized sample across all workers, fills m_slots
+    template <typename t_start, typename t_stop>
+    void sample(int input_sz, t_start& start, t_stop& stop);
+
+    // Most of the algorithm, for each input size
+    template <typename t_start,
+              typename t_stop,
+              typename t_updater>
+    void collect_for_input_size(int input_sz,
+                                t_start& start,
+                                t_stop& stop,
+                                t_updater& u);
+
+    const double m_alpha;
+    const double m_beta_min;
+    const int m_min_incr;
+    const int m_max_incr;
+    const int m_max_rounds;
+    const int m_n_init;
+    const std::vector<int> m_cpus;
+    spin_barrier m_barrier;
+    std::unique_ptr<slot[], slots_deleter> m_slots;
+    bool m_use_instr;   // Chosen once all workers have opened their counters
+    int m_input_sz;     // Published to the workers before each release
+    bool m_quit;        // Only written while all workers wait to be released
+};
+
+inline parallel_collector::spin_barrier::spin_barrier(int n)
+    : m_n(n)
+    , m_waiting(0)
+    , m_gen(0)
+{
+}
+
+inline bool
+parallel_collector::spin_barrier::arrive()
+{
+    if (m_waiting.fetch_add(1, std::memory_order_acq_rel) + 1 == m_n) {
+        m_waiting.store(0, std::memory_order_relaxed);
+        m_gen.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+    return false;
+}
+
+inline void
+parallel_collector::spin_barrier::wait()
+{
+    const unsigned gen = m_gen.load(std::memory_order_acquire);
+    if (arrive()) {
+        return;
+    }
+    for (int spins = 0; m_gen.load(std::memory_order_acquire) == gen;
+         ++spins) {
+        // Give the CPU away now and then in case we share it
+        if (spins > 4096) {
+            std::this_thread::yield();
+            spins = 0;
+        }
+    }
+}
+
+inline void
+parallel_collector::slots_deleter::operator()(slot* s) const
+{
+    for (size_t i = 0; i < n; ++i) {
+        s[i].~slot();
+    }
+    free(s);
+}
+
+inline std::unique_ptr<parallel_collector::slot[],
+                       parallel_collector::slots_deleter>
+parallel_collector::make_slots(size_t n)
+{
+    void* p      = nullptr;
+    const int rc = posix_memalign(&p,
+                                  alignof(slot),
+                                  std::max<size_t>(n, 1) * sizeof(slot));
+    if (rc != 0) {
+        throw std::system_error(ENOMEM, std::system_category());
+    }
+    // slot's members can't throw on construction
+    slot* s = static_cast<slot*>(p);
+    for (size_t i = 0; i < n; ++i) {
+        new (&s[i]) slot();
+    }
+    return std::unique_ptr<slot[], slots_deleter>(s, slots_deleter{n});
+}
+
+inline parallel_collector::parallel_collector(double alpha,
+                                              double beta_min,
+                                              int min_incr,
+                                              int max_incr,
+                                              int max_rounds,
+                                              int n_init,
+                                              std::vector<int> cpus)
+    : m_alpha(alpha)
+    , m_beta_min(beta_min)
+    , m_min_incr(min_incr)
+    , m_max_incr(max_incr)
+    , m_max_rounds(max_rounds)
+    , m_n_init(n_init)
+    , m_cpus(std::move(cpus))
+    , m_barrier((int)m_cpus.size() + 1)
+    , m_slots(make_slots(m_cpus.size()))
+    , m_use_instr(false)
+    , m_input_sz(0)
+    , m_quit(false)
+{
+}
+
+inline size_t
+parallel_collector::get_num_threads() const
+{
+    return m_cpus.size();
+}
+
+template <typename t_start, typename t_stop, typename t_run, typename t_updater>
+void
+parallel_collector::collect(int N,
+                            int num_runs,
+                            t_start start,
+                            t_stop stop,
+                            t_run run,
+                            t_updater u)
+{
+    const size_t T = m_cpus.size();
+    m_quit         = false;
+    for (size_t i = 0; i < T; ++i) {
+        m_slots[i].cnt       = 0;
+        m_slots[i].instr_idx = -1;
+        m_slots[i].task_idx  = -1;
+        m_slots[i].error     = nullptr;
+    }
+
+    std::vector<std::thread> threads;
+    std::exception_ptr error;
+    try {
+        for (size_t i = 0; i < T; ++i) {
+            threads.emplace_back([this, i, &run] { worker((int)i, run); });
+        }
+    } catch (...) {
+        // Stand in for the workers that never started
+        error = std::current_exception();
+        for (size_t i = threads.size(); i < T; ++i) {
+            m_barrier.arrive();
+        }
+    }
+
+    // Wait for every worker to pin itself and open its counter
+    m_barrier.wait();
+    for (size_t i = 0; i < T && error == nullptr; ++i) {
+        error = m_slots[i].error;
+    }
+
+    if (error == nullptr) {
+        // Only minimize instructions if every worker can count them, and
+        // otherwise every worker needs the task-clock
+        bool instr = true;
+        bool task  = true;
+        for (size_t i = 0; i < T; ++i) {
+            instr = instr && m_slots[i].instr_idx >= 0;
+            task  = task && m_slots[i].task_idx >= 0;
+        }
+        m_use_instr = instr;
+        if (!instr && !task) {
+            error = std::make_exception_ptr(
+                std::system_error(ENOENT, std::system_category()));
+        }
+    }
+
+    if (error == nullptr) {
+        try {
+            for (int i = 0; i < num_runs; ++i, N *= 2) {
+                collect_for_input_size(N, start, stop, u);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+
+    // Release the workers one last time so they see m_quit and leave
+    m_quit = true;
+    for (size_t i = threads.size(); i < T; ++i) {
+        m_barrier.arrive();
+    }
+    m_barrier.wait();
+    for (auto& t : threads) {
+        t.join();
+    }
+    if (error != nullptr) {
+        std::rethrow_exception(error);
+    }
+}
+
+template <typename t_run>
+void
+parallel_collector::worker(int tid, t_run& run)
+{
+    slot& s = m_slots[tid];
+    try {
+        pin_self(m_cpus[tid]);
+    } catch (...) {
+        s.error = std::current_exception();
+    }
+    fixed_counter<2> c({event::hw(PERF_COUNT_HW_INSTRUCTIONS),
+                        event::sw(PERF_COUNT_SW_TASK_CLOCK)},
+                       counter::READ_RDPMC);
+    s.instr_idx = c.find(event::hw(PERF_COUNT_HW_INSTRUCTIONS));
+    s.task_idx  = c.find(event::sw(PERF_COUNT_SW_TASK_CLOCK));
+    m_barrier.wait();
+
+    for (;;) {
+        m_barrier.wait();
+        if (m_quit) {
+            break;
+        }
+        if (s.error == nullptr) {
+            try {
+                c.start();
+                run(m_input_sz, tid);
+                c.stop();
+                if (c.is_unscheduled()) {
+                    // Redoing one thread's window would change what the
+                    // others ran concurrently with, so give up
+                    throw std::system_error(EAGAIN, std::system_category());
+                }
+                s.cnt = c.get_counts()[m_use_instr ? s.instr_idx : s.task_idx];
+            } catch (...) {
+                s.error = std::current_exception();
+            }
+        }
+        m_barrier.wait();
+    }
+}
+
+template <typename t_start, typename t_stop>
+void
+parallel_collector::sample(int N, t_start& start, t_stop& stop)
+{
+    start(N);
+    m_input_sz = N;
+    m_barrier.wait();  // Release the workers
+    m_barrier.wait();  // And wait for all of them to finish
+    stop(N);
+    for (size_t i = 0; i < m_cpus.size(); ++i) {
+        if (m_slots[i].error != nullptr) {
+            std::rethrow_exception(m_slots[i].error);
+        }
+    }
+}
+
+template <typename t_start, typename t_stop, typename t_updater>
+void
+parallel_collector::collect_for_input_size(int input_sz,
+                                           t_start& start,
+                                           t_stop& stop,
+                                           t_updater& u)
+{
+    const size_t T = m_cpus.size();
+    estimator total(m_alpha, m_beta_min, m_min_incr, m_max_incr);
+    std::vector<estimator> per_thread(
+        T, estimator(m_alpha, m_beta_min, m_min_incr, m_max_incr));
+    int n = m_n_init;
+    for (int i = 0; i < m_max_rounds; ++i) {
+        // Gather counts based on the current value of n
+        for (int i = 0; i < n; ++i) {
+            sample(input_sz, start, stop);
+            long long cnt = 0;
+            for (size_t t = 0; t < T; ++t) {
+                per_thread[t].add(m_slots[t].cnt);
+                cnt += m_slots[t].cnt;
+            }
+            total.add(cnt);
+        }
+        if (total.update()) {
+            break;
+        }
+        n = total.get_next_n();
+    }
+    for (auto& e : per_thread) {
+        e.update();
+    }
+    u(input_sz, total.get_sum(), total.get_L_hat(), total.get_n_tot(),
+      per_thread);
+}
+}
+
+#endif  // _EXP_PERF_PARALLEL_COLLECTOR_H
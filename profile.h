@@ -0,0 +1,281 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_PROFILE_H
+#define _EXP_PERF_PROFILE_H
+
+#include "sampler.h"
+
+#include <dlfcn.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// Where the slow samples of a collect() spend their time that the fast ones
+// don't.
+//
+// Every window of the collector is also sampled by a sampler. Once an input
+// size is done its windows are ranked by the count of the target: the
+// samples of the fastest windows, those near L_hat, go to one IP histogram
+// and the samples of the slowest, the tail that pushes xbar - L_hat up, go to
+// another. diff() then shows which code paths are overrepresented in the
+// tail.
+//
+// For example:
+//
+// collector c(...);
+// profile p(event::hw(PERF_COUNT_HW_CPU_CYCLES), 10000);
+// c.set_profile(&p);
+// c.collect(N, runs, start, stop, run, u);
+// p.write(stdout);
+//
+// The sampler samples the thread that constructed it, so collect on that
+// thread and don't sweep.
+//
+class profile
+{
+  public:
+    // One address of diff()
+    struct entry {
+        uint64_t ip;
+        double near;  // Share of the near samples at ip
+        double tail;  // Share of the tail samples at ip
+        double diff;  // tail - near
+    };
+
+    // e, period, callchain - see sampler
+    // near - the fraction of the windows of an input size, from the fastest,
+    // whose samples count as near L_hat
+    // tail - the fraction, from the slowest, that counts as the tail
+    profile(const event& e,
+            uint64_t period,
+            double near    = 0.25,
+            double tail    = 0.1,
+            bool callchain = true);
+
+    sampler& get_sampler();
+
+    // Keep the samples of the window the sampler just stopped, whose count
+    // of the target was count
+    void add(long long count);
+
+    // Rank the windows kept since the last call, and add the samples of the
+    // fastest and slowest ones to the histograms
+    void end_input_size();
+
+    // Every address in either histogram, most overrepresented in the tail
+    // first. By the sampled ip, or with inclusive by every address of the
+    // callchain, so that a caller also gets the samples of its callees.
+    // Shares of a histogram without samples are 0.
+    std::vector<entry> diff(bool inclusive = false) const;
+
+    // How many samples each histogram holds
+    uint64_t get_near_samples() const;
+    uint64_t get_tail_samples() const;
+
+    // Forget everything, say to profile input sizes separately from the
+    // updater
+    void clear();
+
+    // Print the first max_entries of diff(), with the object and symbol of
+    // each address where dladdr() knows them. On glibc before 2.34 link with
+    // -ldl.
+    void write(FILE* f,
+               size_t max_entries = 20,
+               bool inclusive     = false) const;
+
+  private:
+    using histogram = std::map<uint64_t, uint64_t>;
+    using window    = std::pair<long long, std::vector<sampler::sample>>;
+
+    // Add the samples of one window to a pair of histograms
+    static void count(const std::vector<sampler::sample>& samples,
+                      histogram& self,
+                      histogram& incl);
+
+    sampler m_sampler;
+    const double m_near;
+    const double m_tail;
+    std::vector<window> m_windows;  // Count and samples, of this input size
+    histogram m_near_self;
+    histogram m_tail_self;
+    histogram m_near_incl;
+    histogram m_tail_incl;
+    uint64_t m_near_n;
+    uint64_t m_tail_n;
+};
+
+inline profile::profile(const event& e,
+                        uint64_t period,
+                        double near,
+                        double tail,
+                        bool callchain)
+    : m_sampler(e, period, callchain)
+    , m_near(near)
+    , m_tail(tail)
+    , m_near_n(0)
+    , m_tail_n(0)
+{
+}
+
+inline sampler&
+profile::get_sampler()
+{
+    return m_sampler;
+}
+
+inline void
+profile::add(long long count)
+{
+    m_windows.emplace_back(count, std::vector<sampler::sample>());
+    m_sampler.take(m_windows.back().second);
+}
+
+inline void
+profile::count(const std::vector<sampler::sample>& samples,
+               histogram& self,
+               histogram& incl)
+{
+    for (const auto& s : samples) {
+        ++self[s.ip];
+        if (s.callchain.empty()) {
+            ++incl[s.ip];
+            continue;
+        }
+        // Count a recursive caller once per sample
+        for (size_t i = 0; i < s.callchain.size(); ++i) {
+            const uint64_t a = s.callchain[i];
+            if (std::find(s.callchain.begin(), s.callchain.begin() + i, a) ==
+                s.callchain.begin() + i) {
+                ++incl[a];
+            }
+        }
+    }
+}
+
+inline void
+profile::end_input_size()
+{
+    const size_t n = m_windows.size();
+    if (n >= 2) {
+        std::stable_sort(m_windows.begin(),
+                         m_windows.end(),
+                         [](const window& x, const window& y) {
+                             return x.first < y.first;
+                         });
+        // At least one window each, and never the same one in both
+        const size_t k_near = std::min(
+            n - 1, std::max<size_t>(1, (size_t)std::lround(n * m_near)));
+        const size_t k_tail = std::min(
+            n - k_near, std::max<size_t>(1, (size_t)std::lround(n * m_tail)));
+        for (size_t i = 0; i < k_near; ++i) {
+            m_near_n += m_windows[i].second.size();
+            count(m_windows[i].second, m_near_self, m_near_incl);
+        }
+        for (size_t i = n - k_tail; i < n; ++i) {
+            m_tail_n += m_windows[i].second.size();
+            count(m_windows[i].second, m_tail_self, m_tail_incl);
+        }
+    }
+    m_windows.clear();
+}
+
+inline std::vector<profile::entry>
+profile::diff(bool inclusive) const
+{
+    const histogram& near = inclusive ? m_near_incl : m_near_self;
+    const histogram& tail = inclusive ? m_tail_incl : m_tail_self;
+    // A side without samples, say after clear() or when every window was
+    // rejected, has a share of 0 everywhere
+    const auto share = [](uint64_t k, uint64_t n) {
+        return n == 0 ? 0 : (double)k / n;
+    };
+    std::map<uint64_t, entry> all;
+    for (const auto& x : near) {
+        all[x.first] = entry{x.first, share(x.second, m_near_n), 0, 0};
+    }
+    for (const auto& x : tail) {
+        entry& e = all[x.first];
+        e.ip     = x.first;
+        e.tail   = share(x.second, m_tail_n);
+    }
+
+    std::vector<entry> entries;
+    for (auto& x : all) {
+        x.second.diff = x.second.tail - x.second.near;
+        entries.push_back(x.second);
+    }
+    std::stable_sort(entries.begin(),
+                     entries.end(),
+                     [](const entry& x, const entry& y) {
+                         return x.diff > y.diff;
+                     });
+    return entries;
+}
+
+inline uint64_t
+profile::get_near_samples() const
+{
+    return m_near_n;
+}
+
+inline uint64_t
+profile::get_tail_samples() const
+{
+    return m_tail_n;
+}
+
+inline void
+profile::clear()
+{
+    m_windows.clear();
+    m_near_self.clear();
+    m_tail_self.clear();
+    m_near_incl.clear();
+    m_tail_incl.clear();
+    m_near_n = 0;
+    m_tail_n = 0;
+}
+
+inline void
+profile::write(FILE* f, size_t max_entries, bool inclusive) const
+{
+    fprintf(f,
+            "%llu near samples, %llu tail samples\n",
+            (unsigned long long)m_near_n,
+            (unsigned long long)m_tail_n);
+    fprintf(f, "%8s %8s %8s  %s\n", "tail%", "near%", "diff%", "address");
+    const std::vector<entry> entries = diff(inclusive);
+    for (size_t i = 0; i < entries.size() && i < max_entries; ++i) {
+        const entry& e = entries[i];
+        fprintf(f,
+                "%8.2f %8.2f %+8.2f  %#llx",
+                100 * e.tail,
+                100 * e.near,
+                100 * e.diff,
+                (unsigned long long)e.ip);
+        Dl_info info;
+        if (dladdr(reinterpret_cast<void*>(e.ip), &info) != 0 &&
+            info.dli_fname != nullptr) {
+            // The offset into the object is what addr2line -e wants
+            fprintf(f,
+                    " %s+%#llx",
+                    info.dli_fname,
+                    (unsigned long long)(e.ip - (uint64_t)info.dli_fbase));
+            if (info.dli_sname != nullptr) {
+                fprintf(f, " %s", info.dli_sname);
+            }
+        }
+        fprintf(f, "\n");
+    }
+}
+}
+
+#endif  // _EXP_PERF_PROFILE_H
@@ -0,0 +1,196 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_REGRESSION_H
+#define _EXP_PERF_REGRESSION_H
+
+#include <cmath>
+#include <map>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// The results of one collect(), keyed by input size.
+//
+// Has the signature of an updater, so it can be handed to collect() directly.
+// collect() takes the updater by value, so pass it with std::ref:
+//
+// results base;
+// c.collect(N, runs, start, stop, run, std::ref(base));
+//
+class results
+{
+  public:
+    // What the updater receives for one input size
+    struct summary {
+        double sum;
+        long long L_hat;
+        int n_tot;
+    };
+
+    void add(int input_sz, double sum, long long L_hat, int n_tot);
+
+    void operator()(int input_sz, double sum, long long L_hat, int n_tot);
+
+    const std::map<int, summary>& get() const;
+
+  private:
+    std::map<int, summary> m_results;
+};
+
+//
+// Decides whether a candidate run regressed against a baseline.
+//
+// Each run estimates the shift L of a shifted exponential. Since L_hat =
+// min(X_i) >= L, and L_hat - L is exponential with rate n * lam,
+//
+//   [L_hat - e, L_hat],  e = -log(alpha) / (n_tot * lam_hat)
+//
+// holds L with probability 1 - alpha. The candidate is SLOWER when even the
+// lower end of its interval is more than beta_min * L_hat above the baseline
+// L_hat, which is as large as the baseline L can be. A candidate whose true L
+// is within beta_min of the baseline is then called SLOWER with probability at
+// most alpha. FASTER is the same test the other way around.
+//
+// Use the alpha and beta_min the runs were collected with: a collector stops
+// once e <= beta_min * L_hat, so a shift of a few beta_min is then resolved.
+//
+class comparator
+{
+  public:
+    enum {
+        SAME    = 0,  // No significant shift
+        FASTER  = 1,  // The candidate's L is significantly lower
+        SLOWER  = 2,  // The candidate's L is significantly higher
+        MISSING = 3   // The baseline has this input size but not the candidate
+    };
+
+    // The outcome for one input size
+    struct verdict {
+        int input_sz;
+        int result;           // One of the above
+        long long base_L_hat;
+        long long cand_L_hat;
+        double base_e;        // Width of the confidence interval of each L
+        double cand_e;
+        double shift;         // cand_L_hat / base_L_hat - 1
+    };
+
+    comparator(double alpha, double beta_min);
+
+    // One verdict per input size of base, in increasing input size. Sizes
+    // that only the candidate has are ignored.
+    std::vector<verdict> compare(const results& base,
+                                 const results& cand) const;
+
+    // The verdict for one input size
+    verdict compare(int input_sz,
+                    const results::summary& base,
+                    const results::summary& cand) const;
+
+    // Whether no input size is SLOWER or MISSING
+    static bool passed(const std::vector<verdict>& verdicts);
+
+  private:
+    // The width of the confidence interval of L
+    double interval(const results::summary& s) const;
+
+    const double m_log_alpha;
+    const double m_beta_min;
+};
+
+inline void
+results::add(int input_sz, double sum, long long L_hat, int n_tot)
+{
+    m_results[input_sz] = summary{sum, L_hat, n_tot};
+}
+
+inline void
+results::operator()(int input_sz, double sum, long long L_hat, int n_tot)
+{
+    add(input_sz, sum, L_hat, n_tot);
+}
+
+inline const std::map<int, results::summary>&
+results::get() const
+{
+    return m_results;
+}
+
+inline comparator::comparator(double alpha, double beta_min)
+    : m_log_alpha(std::log(alpha))
+    , m_beta_min(beta_min)
+{
+}
+
+inline double
+comparator::interval(const results::summary& s) const
+{
+    if (s.n_tot <= 0) {
+        return INFINITY;
+    }
+    const double xbar = s.sum / s.n_tot;
+    if (xbar <= s.L_hat) {
+        // Every sample was the minimum
+        return 0;
+    }
+    // -log(alpha) / (n_tot * lam_hat) where lam_hat = 1 / (xbar - L_hat)
+    return -m_log_alpha * (xbar - s.L_hat) / s.n_tot;
+}
+
+inline std::vector<comparator::verdict>
+comparator::compare(const results& base, const results& cand) const
+{
+    std::vector<verdict> verdicts;
+    for (const auto& b : base.get()) {
+        const auto c = cand.get().find(b.first);
+        if (c != cand.get().end()) {
+            verdicts.push_back(compare(b.first, b.second, c->second));
+            continue;
+        }
+        verdict v    = {};
+        v.input_sz   = b.first;
+        v.result     = MISSING;
+        v.base_L_hat = b.second.L_hat;
+        v.base_e     = interval(b.second);
+        verdicts.push_back(v);
+    }
+    return verdicts;
+}
+
+inline comparator::verdict
+comparator::compare(int input_sz,
+                    const results::summary& base,
+                    const results::summary& cand) const
+{
+    verdict v    = {};
+    v.input_sz   = input_sz;
+    v.base_L_hat = base.L_hat;
+    v.cand_L_hat = cand.L_hat;
+    v.base_e     = interval(base);
+    v.cand_e     = interval(cand);
+    v.shift = v.base_L_hat > 0 ? (double)v.cand_L_hat / v.base_L_hat - 1 : 0;
+
+    if (v.cand_L_hat - v.cand_e > v.base_L_hat * (1 + m_beta_min)) {
+        v.result = SLOWER;
+    } else if (v.base_L_hat - v.base_e > v.cand_L_hat * (1 + m_beta_min)) {
+        v.result = FASTER;
+    } else {
+        v.result = SAME;
+    }
+    return v;
+}
+
+inline bool
+comparator::passed(const std::vector<verdict>& verdicts)
+{
+    for (const auto& v : verdicts) {
+        if (v.result == SLOWER || v.result == MISSING) {
+            return false;
+        }
+    }
+    return true;
+}
+}
+
+#endif  // _EXP_PERF_REGRESSION_H
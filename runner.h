@@ -0,0 +1,501 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_RUNNER_H
+#define _EXP_PERF_RUNNER_H
+
+#include "affinity.h"
+#include "benchmark.h"
+#include "collector.h"
+#include "environment.h"
+#include "overhead.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <regex>
+#include <string>
+
+namespace exp_perf
+{
+//
+// Runs the benchmarks of registry from the command line.
+//
+// Put EXP_PERF_MAIN() in one of the files defining benchmarks, and link them
+// into one binary:
+//
+//   ./bench --filter='^sort' --min=1024 --max=1048576 --format=csv
+//
+// Options:
+//
+//   --list              print the names of the benchmarks and exit
+//   --filter=REGEX      only run benchmarks whose name matches
+//   --min=N, --max=N    the input sizes, doubling from min while <= max
+//   --bytes-per-element=B
+//                       instead follow the caches, see cache_schedule()
+//   --alpha=, --beta=, --min-incr=, --max-incr=, --max-rounds=, --n-init=
+//                       override the parameters of collector
+//   --batch=K           see collector::set_batch(), 0 calibrates
+//   --subtract-floor    see collector::set_subtract_floor()
+//   --format=FMT        text, csv or jsonl (one JSON object per line)
+//   --cpu=C             pin the benchmarks to CPU C
+//   --quiet-cpu         pin them to find_quiet_cpu() instead
+//   --preflight=MODE    off, warn or refuse: check the environment of the
+//                       CPU first, see check_environment(), and print its
+//                       warnings, or exit with 1 if there are any. Unless
+//                       off, the environment is printed ahead of the
+//                       results, as a # comment or a JSON object.
+//   --fork              run every benchmark in a child process, so that
+//                       no state leaks from one to the next
+//   --overhead          instead of the benchmarks, print the floor of every
+//                       backend and number of events, see
+//                       measure_overheads(), one row each. The columns and
+//                       keys don't change, so that the rows of successive
+//                       runs can be compared.
+//
+// Exits with 0 if every benchmark ran, 1 if any failed and 2 on bad options.
+//
+class runner
+{
+  public:
+    enum {
+        FORMAT_TEXT  = 0,
+        FORMAT_CSV   = 1,
+        FORMAT_JSONL = 2
+    };
+
+    enum {
+        PREFLIGHT_OFF    = 0,
+        PREFLIGHT_WARN   = 1,
+        PREFLIGHT_REFUSE = 2
+    };
+
+    runner(int argc, char** argv);
+
+    // Run the selected benchmarks, returns the exit status
+    int run();
+
+  private:
+    // Parse one option, returns false if it is unknown or malformed
+    bool parse(const char* arg);
+
+    // Check and print the environment, returns false to refuse to run
+    bool preflight() const;
+
+    // Collect and print one benchmark, returns 0 on success
+    int run_one(const benchmark& b) const;
+
+    // Measure and print the floors, see --overhead
+    void print_overheads() const;
+
+    void print(const benchmark& b,
+               const collector& c,
+               int input_sz,
+               double sum,
+               long long L_hat,
+               int n_tot) const;
+
+    static void usage(const char* prog);
+
+    const char* m_prog;
+    bool m_ok;
+    bool m_list;
+    std::string m_filter;
+    int m_min;
+    int m_max;
+    int m_bytes_per_element;
+    double m_alpha;
+    double m_beta;
+    int m_min_incr;
+    int m_max_incr;
+    int m_max_rounds;
+    int m_n_init;
+    int m_batch;
+    int m_format;
+    int m_cpu;
+    bool m_quiet_cpu;
+    int m_preflight;
+    bool m_fork;
+    bool m_overhead;
+    bool m_subtract_floor;
+};
+
+inline runner::runner(int argc, char** argv)
+    : m_prog(argc > 0 ? argv[0] : "bench")
+    , m_ok(true)
+    , m_list(false)
+    , m_min(1024)
+    , m_max(16384)
+    , m_bytes_per_element(0)
+    , m_alpha(0.05)
+    , m_beta(0.01)
+    , m_min_incr(10)
+    , m_max_incr(1000)
+    , m_max_rounds(20)
+    , m_n_init(50)
+    , m_batch(1)
+    , m_format(FORMAT_TEXT)
+    , m_cpu(-1)
+    , m_quiet_cpu(false)
+    , m_preflight(PREFLIGHT_WARN)
+    , m_fork(false)
+    , m_overhead(false)
+    , m_subtract_floor(false)
+{
+    for (int i = 1; i < argc && m_ok; ++i) {
+        m_ok = parse(argv[i]);
+        if (!m_ok) {
+            fprintf(stderr, "%s: bad option %s\n", m_prog, argv[i]);
+        }
+    }
+}
+
+inline bool
+runner::parse(const char* arg)
+{
+    const char* eq = strchr(arg, '=');
+    const std::string opt(arg, eq != nullptr ? eq - arg : strlen(arg));
+    const char* val = eq != nullptr ? eq + 1 : nullptr;
+    char* end       = nullptr;
+
+    if (opt == "--list" && val == nullptr) {
+        m_list = true;
+    } else if (opt == "--fork" && val == nullptr) {
+        m_fork = true;
+    } else if (opt == "--quiet-cpu" && val == nullptr) {
+        m_quiet_cpu = true;
+    } else if (opt == "--overhead" && val == nullptr) {
+        m_overhead = true;
+    } else if (opt == "--subtract-floor" && val == nullptr) {
+        m_subtract_floor = true;
+    } else if (val == nullptr || *val == 0) {
+        return false;
+    } else if (opt == "--filter") {
+        m_filter = val;
+    } else if (opt == "--format") {
+        const std::string f(val);
+        if (f == "text") {
+            m_format = FORMAT_TEXT;
+        } else if (f == "csv") {
+            m_format = FORMAT_CSV;
+        } else if (f == "jsonl") {
+            m_format = FORMAT_JSONL;
+        } else {
+            return false;
+        }
+    } else if (opt == "--preflight") {
+        const std::string p(val);
+        if (p == "off") {
+            m_preflight = PREFLIGHT_OFF;
+        } else if (p == "warn") {
+            m_preflight = PREFLIGHT_WARN;
+        } else if (p == "refuse") {
+            m_preflight = PREFLIGHT_REFUSE;
+        } else {
+            return false;
+        }
+    } else if (opt == "--alpha" || opt == "--beta") {
+        const double x = strtod(val, &end);
+        if (*end != 0 || x <= 0 || x >= 1) {
+            return false;
+        }
+        (opt == "--alpha" ? m_alpha : m_beta) = x;
+    } else {
+        const long x = strtol(val, &end, 10);
+        if (*end != 0 || x < 0) {
+            return false;
+        }
+        if (opt == "--min") {
+            m_min = (int)x;
+        } else if (opt == "--max") {
+            m_max = (int)x;
+        } else if (opt == "--bytes-per-element") {
+            m_bytes_per_element = (int)x;
+        } else if (opt == "--min-incr") {
+            m_min_incr = (int)x;
+        } else if (opt == "--max-incr") {
+            m_max_incr = (int)x;
+        } else if (opt == "--max-rounds") {
+            m_max_rounds = (int)x;
+        } else if (opt == "--n-init") {
+            m_n_init = (int)x;
+        } else if (opt == "--batch") {
+            m_batch = (int)x;
+        } else if (opt == "--cpu") {
+            m_cpu = (int)x;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void
+runner::usage(const char* prog)
+{
+    fprintf(stderr,
+            "usage: %s [--list] [--filter=REGEX] [--min=N] [--max=N]\n"
+            "  [--bytes-per-element=B]\n"
+            "  [--alpha=A] [--beta=B] [--min-incr=N] [--max-incr=N]\n"
+            "  [--max-rounds=N] [--n-init=N] [--batch=K] [--subtract-floor]\n"
+            "  [--format=text|csv|jsonl] [--cpu=C] [--quiet-cpu]\n"
+            "  [--preflight=off|warn|refuse] [--fork] [--overhead]\n",
+            prog);
+}
+
+inline int
+runner::run()
+{
+    if (!m_ok || m_min < 1 || m_max < m_min) {
+        usage(m_prog);
+        return 2;
+    }
+    std::regex filter;
+    try {
+        filter = std::regex(m_filter);
+    } catch (const std::regex_error&) {
+        fprintf(stderr, "%s: bad filter %s\n", m_prog, m_filter.c_str());
+        return 2;
+    }
+
+    if (m_list) {
+        for (const auto& b : registry::get()) {
+            if (std::regex_search(b.name, filter)) {
+                printf("%s\n", b.name.c_str());
+            }
+        }
+        return 0;
+    }
+
+    const int cpu = m_cpu < 0 && m_quiet_cpu ? find_quiet_cpu() : m_cpu;
+    if (cpu >= 0) {
+        // Inherited by the children with --fork
+        try {
+            pin_self(cpu);
+        } catch (const std::exception& e) {
+            fprintf(stderr, "%s: cpu %d: %s\n", m_prog, cpu, e.what());
+            return 1;
+        }
+    }
+    if (!preflight()) {
+        return 1;
+    }
+    if (m_overhead) {
+        print_overheads();
+        return 0;
+    }
+    if (m_format == FORMAT_CSV) {
+        printf("name,input_sz,L_hat,n_tot,mean,batch,backend,type,config\n");
+    } else if (m_format == FORMAT_TEXT) {
+        printf("%-32s %12s %14s %8s %14s %6s\n",
+               "name",
+               "input_sz",
+               "L_hat",
+               "n_tot",
+               "mean",
+               "batch");
+    }
+
+    int failed = 0;
+    for (const auto& b : registry::get()) {
+        if (!std::regex_search(b.name, filter)) {
+            continue;
+        }
+        if (!m_fork) {
+            failed += run_one(b);
+            continue;
+        }
+        // Don't let the child flush our buffered output a second time
+        fflush(stdout);
+        const pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            const int rc = run_one(b);
+            fflush(stdout);
+            _exit(rc);
+        }
+        int status = 0;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s: %s failed\n", m_prog, b.name.c_str());
+            ++failed;
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+inline bool
+runner::preflight() const
+{
+    if (m_preflight == PREFLIGHT_OFF) {
+        return true;
+    }
+    const environment env = check_environment();
+    if (m_format == FORMAT_JSONL) {
+        printf("{\"environment\":%s}\n", env.to_json().c_str());
+    } else {
+        printf("# %s\n", env.to_string().c_str());
+    }
+    const std::vector<std::string> warnings = env.warnings();
+    for (const auto& w : warnings) {
+        fprintf(stderr, "%s: warning: %s\n", m_prog, w.c_str());
+    }
+    if (m_preflight == PREFLIGHT_REFUSE && !warnings.empty()) {
+        fprintf(stderr, "%s: refusing to run, see --preflight\n", m_prog);
+        return false;
+    }
+    return true;
+}
+
+inline int
+runner::run_one(const benchmark& b) const
+{
+    std::vector<int> sizes;
+    if (m_bytes_per_element > 0) {
+        sizes = cache_schedule(m_min, m_max, m_bytes_per_element);
+    } else {
+        for (long long N = m_min; N <= m_max; N *= 2) {
+            sizes.push_back((int)N);
+        }
+    }
+    try {
+        collector c(m_alpha,
+                    m_beta,
+                    m_min_incr,
+                    m_max_incr,
+                    m_max_rounds,
+                    m_n_init);
+        c.set_batch(m_batch);
+        c.set_subtract_floor(m_subtract_floor);
+        c.collect(sizes,
+                  b.start,
+                  b.stop,
+                  b.run,
+                  [&](int input_sz, double sum, long long L_hat, int n_tot) {
+                      print(b, c, input_sz, sum, L_hat, n_tot);
+                  });
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s: %s: %s\n", m_prog, b.name.c_str(), e.what());
+        return 1;
+    }
+    return 0;
+}
+
+inline void
+runner::print_overheads() const
+{
+    if (m_format == FORMAT_CSV) {
+        printf("backend,event,events,floor,mean,n\n");
+    } else if (m_format == FORMAT_TEXT) {
+        printf("%-8s %-14s %6s %14s %14s %8s\n",
+               "backend",
+               "event",
+               "events",
+               "floor",
+               "mean",
+               "n");
+    }
+    for (const auto& o : measure_overheads()) {
+        const std::string name = o.target.name();
+        switch (m_format) {
+        case FORMAT_CSV:
+            printf("%s,%s,%d,%lld,%.2f,%d\n",
+                   o.backend.c_str(),
+                   name.c_str(),
+                   o.events,
+                   o.floor,
+                   o.mean,
+                   o.n);
+            break;
+        case FORMAT_JSONL:
+            // Event names need no escaping
+            printf("{\"backend\":\"%s\",\"event\":\"%s\",\"events\":%d,"
+                   "\"floor\":%lld,\"mean\":%.2f,\"n\":%d}\n",
+                   o.backend.c_str(),
+                   name.c_str(),
+                   o.events,
+                   o.floor,
+                   o.mean,
+                   o.n);
+            break;
+        default:
+            printf("%-8s %-14s %6d %14lld %14.2f %8d\n",
+                   o.backend.c_str(),
+                   name.c_str(),
+                   o.events,
+                   o.floor,
+                   o.mean,
+                   o.n);
+            break;
+        }
+    }
+    fflush(stdout);
+}
+
+inline void
+runner::print(const benchmark& b,
+              const collector& c,
+              int input_sz,
+              double sum,
+              long long L_hat,
+              int n_tot) const
+{
+    const double mean = n_tot > 0 ? sum / n_tot : 0;
+    const event& t    = c.get_target();
+    switch (m_format) {
+    case FORMAT_CSV:
+        printf("%s,%d,%lld,%d,%.2f,%d,%s,%u,%llu\n",
+               b.name.c_str(),
+               input_sz,
+               L_hat,
+               n_tot,
+               mean,
+               c.get_batch(),
+               c.get_backend_name(),
+               t.type,
+               (unsigned long long)t.config);
+        break;
+    case FORMAT_JSONL:
+        // Names are identifiers, so they need no escaping
+        printf("{\"name\":\"%s\",\"input_sz\":%d,\"L_hat\":%lld,"
+               "\"n_tot\":%d,\"mean\":%.2f,\"batch\":%d,\"backend\":\"%s\","
+               "\"type\":%u,\"config\":%llu}\n",
+               b.name.c_str(),
+               input_sz,
+               L_hat,
+               n_tot,
+               mean,
+               c.get_batch(),
+               c.get_backend_name(),
+               t.type,
+               (unsigned long long)t.config);
+        break;
+    default:
+        printf("%-32s %12d %14lld %8d %14.2f %6d\n",
+               b.name.c_str(),
+               input_sz,
+               L_hat,
+               n_tot,
+               mean,
+               c.get_batch());
+        break;
+    }
+    fflush(stdout);
+}
+}
+
+// Define main() as the runner, in exactly one file of the benchmark binary
+#define EXP_PERF_MAIN()                                                       \
+    int main(int argc, char** argv)                                          \
+    {                                                                        \
+        return ::exp_perf::runner(argc, argv).run();                         \
+    }
+
+#endif  // _EXP_PERF_RUNNER_H
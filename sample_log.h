@@ -0,0 +1,367 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_SAMPLE_LOG_H
+#define _EXP_PERF_SAMPLE_LOG_H
+
+#include "event.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// On disk layout of a sample log.
+//
+// The file is a sample_log_header, num_events sample_log_event describing
+// the columns, padding to records_offset, and then capacity records of
+// record_size bytes each:
+//
+//   int32_t input_sz;
+//   int32_t round;
+//   uint64_t timestamp_ns;  // CLOCK_MONOTONIC
+//   int64_t counts[num_events];
+//
+struct sample_log_header {
+    char magic[8];  // "EXPPERF\0"
+    uint32_t version;
+    uint32_t num_events;
+    uint64_t capacity;
+    uint64_t record_size;
+    uint64_t records_offset;
+    uint32_t ring;  // 1 if old records get overwritten once full
+    uint32_t pad;
+    uint64_t count;  // Records appended so far, including lost ones
+};
+
+struct sample_log_event {
+    uint32_t type;
+    int32_t group;
+    uint64_t config;
+};
+
+//
+// Appends every raw sample to a preallocated, memory mapped file.
+//
+// The file is sized for capacity records up front, so append() only copies
+// the counts into the mapping: no allocation, formatting or syscall beyond
+// reading the vDSO clock. Once full, a ring log overwrites its oldest
+// records, otherwise new records are dropped. In both cases the header keeps
+// counting, so a reader can tell how many were lost.
+//
+// Slots are reserved atomically, so collectors running a sweep on several
+// threads can share one log.
+//
+// For example:
+//
+// collector c(...);
+// sample_log log("samples.bin", c.get_events(), 1 << 20);
+// c.set_sample_log(&log);
+//
+class sample_log
+{
+  public:
+    // path - the file to create, or truncate
+    // events - what each column of counts is, see collector::get_events()
+    // capacity - room for this many records, throws EINVAL if 0
+    // ring - wrap around instead of dropping when full
+    sample_log(const char* path,
+               const std::vector<event>& events,
+               size_t capacity,
+               bool ring = false);
+
+    ~sample_log();
+
+    sample_log(const sample_log&) = delete;
+    sample_log& operator=(const sample_log&) = delete;
+
+    // Append one sample. Only the first num_events counts are kept, missing
+    // ones are written as 0.
+    template <typename t_counts>
+    void append(int input_sz, int round, const t_counts& counts);
+
+    // Records appended so far, including the ones lost to a full log
+    uint64_t get_count() const;
+
+  private:
+    void* m_map;
+    size_t m_map_size;
+    sample_log_header* m_hdr;
+    char* m_records;
+    size_t m_num_events;
+};
+
+//
+// A record read back from a sample log
+//
+struct sample_record {
+    int input_sz;
+    int round;
+    uint64_t timestamp_ns;
+    const int64_t* counts;  // num_events of them
+};
+
+//
+// Maps a sample log read-only to reload its samples, for example to compare
+// the samples of two runs offline.
+//
+class sample_log_reader
+{
+  public:
+    explicit sample_log_reader(const char* path);
+    ~sample_log_reader();
+
+    sample_log_reader(const sample_log_reader&) = delete;
+    sample_log_reader& operator=(const sample_log_reader&) = delete;
+
+    // The columns of counts
+    const std::vector<event>& get_events() const;
+
+    // The number of records still in the log, and how many were lost
+    size_t size() const;
+    uint64_t get_lost() const;
+
+    // The i-th oldest record still in the log
+    sample_record get(size_t i) const;
+
+    // Every count of column ev recorded for input_sz, oldest first
+    std::vector<long long> get_samples(int input_sz, size_t ev) const;
+
+  private:
+    void* m_map;
+    size_t m_map_size;
+    const sample_log_header* m_hdr;
+    const char* m_records;
+    std::vector<event> m_events;
+};
+
+// Values shared by the writer and the reader
+namespace sample_log_format
+{
+static const char magic[8]        = {'E', 'X', 'P', 'P', 'E', 'R', 'F', 0};
+static const uint32_t version     = 1;
+static const size_t record_header = 2 * sizeof(int32_t) + sizeof(uint64_t);
+static const size_t alignment     = 64;
+}
+
+inline sample_log::sample_log(const char* path,
+                              const std::vector<event>& events,
+                              size_t capacity,
+                              bool ring)
+    : m_map(MAP_FAILED)
+    , m_map_size(0)
+    , m_hdr(nullptr)
+    , m_records(nullptr)
+    , m_num_events(events.size())
+{
+    using namespace sample_log_format;
+    if (capacity == 0) {
+        // Nowhere to put a record, and a ring of none can't wrap
+        throw std::system_error(EINVAL, std::system_category());
+    }
+    const size_t record_size =
+        record_header + m_num_events * sizeof(int64_t);
+    const size_t meta =
+        sizeof(sample_log_header) + m_num_events * sizeof(sample_log_event);
+    const size_t records_offset = (meta + alignment - 1) / alignment * alignment;
+    m_map_size                  = records_offset + capacity * record_size;
+
+    const int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category());
+    }
+    if (::ftruncate(fd, m_map_size) < 0) {
+        const int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::system_category());
+    }
+    m_map = ::mmap(
+        nullptr, m_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int err = errno;
+    ::close(fd);
+    if (m_map == MAP_FAILED) {
+        throw std::system_error(err, std::system_category());
+    }
+
+    m_hdr = static_cast<sample_log_header*>(m_map);
+    memcpy(m_hdr->magic, magic, sizeof(magic));
+    m_hdr->version        = version;
+    m_hdr->num_events     = (uint32_t)m_num_events;
+    m_hdr->capacity       = capacity;
+    m_hdr->record_size    = record_size;
+    m_hdr->records_offset = records_offset;
+    m_hdr->ring           = ring ? 1 : 0;
+    m_hdr->count          = 0;
+    sample_log_event* evts =
+        reinterpret_cast<sample_log_event*>(m_hdr + 1);
+    for (size_t i = 0; i < m_num_events; ++i) {
+        evts[i].type   = events[i].type;
+        evts[i].group  = events[i].group;
+        evts[i].config = events[i].config;
+    }
+    m_records = static_cast<char*>(m_map) + records_offset;
+}
+
+inline sample_log::~sample_log()
+{
+    if (m_map != MAP_FAILED) {
+        ::munmap(m_map, m_map_size);
+    }
+}
+
+template <typename t_counts>
+void
+sample_log::append(int input_sz, int round, const t_counts& counts)
+{
+    const uint64_t n = __atomic_fetch_add(&m_hdr->count, 1, __ATOMIC_RELAXED);
+    if (n >= m_hdr->capacity && !m_hdr->ring) {
+        return;
+    }
+    char* rec = m_records + (n % m_hdr->capacity) * m_hdr->record_size;
+
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const int32_t hdr[2] = {input_sz, round};
+    const uint64_t now   = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    memcpy(rec, hdr, sizeof(hdr));
+    memcpy(rec + sizeof(hdr), &now, sizeof(now));
+
+    int64_t* out = reinterpret_cast<int64_t*>(
+        rec + sample_log_format::record_header);
+    for (size_t i = 0; i < m_num_events; ++i) {
+        out[i] = i < counts.size() ? counts[i] : 0;
+    }
+}
+
+inline uint64_t
+sample_log::get_count() const
+{
+    return __atomic_load_n(&m_hdr->count, __ATOMIC_RELAXED);
+}
+
+inline sample_log_reader::sample_log_reader(const char* path)
+    : m_map(MAP_FAILED)
+    , m_map_size(0)
+    , m_hdr(nullptr)
+    , m_records(nullptr)
+{
+    using namespace sample_log_format;
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category());
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        const int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::system_category());
+    }
+    m_map_size = st.st_size;
+    if (m_map_size < sizeof(sample_log_header)) {
+        ::close(fd);
+        throw std::system_error(EINVAL, std::system_category());
+    }
+    m_map         = ::mmap(nullptr, m_map_size, PROT_READ, MAP_SHARED, fd, 0);
+    const int err = errno;
+    ::close(fd);
+    if (m_map == MAP_FAILED) {
+        throw std::system_error(err, std::system_category());
+    }
+
+    m_hdr = static_cast<const sample_log_header*>(m_map);
+    const size_t meta =
+        sizeof(sample_log_header) + m_hdr->num_events * sizeof(sample_log_event);
+    if (memcmp(m_hdr->magic, magic, sizeof(magic)) != 0 ||
+        m_hdr->version != version || m_hdr->capacity == 0 ||
+        m_hdr->records_offset < meta ||
+        m_hdr->record_size !=
+            record_header + m_hdr->num_events * sizeof(int64_t) ||
+        m_map_size <
+            m_hdr->records_offset + m_hdr->capacity * m_hdr->record_size) {
+        ::munmap(m_map, m_map_size);
+        m_map = MAP_FAILED;
+        throw std::system_error(EINVAL, std::system_category());
+    }
+
+    const sample_log_event* evts =
+        reinterpret_cast<const sample_log_event*>(m_hdr + 1);
+    for (size_t i = 0; i < m_hdr->num_events; ++i) {
+        m_events.push_back(
+            event{evts[i].type, evts[i].config, evts[i].group, false});
+    }
+    m_records = static_cast<const char*>(m_map) + m_hdr->records_offset;
+}
+
+inline sample_log_reader::~sample_log_reader()
+{
+    if (m_map != MAP_FAILED) {
+        ::munmap(m_map, m_map_size);
+    }
+}
+
+inline const std::vector<event>&
+sample_log_reader::get_events() const
+{
+    return m_events;
+}
+
+inline size_t
+sample_log_reader::size() const
+{
+    return m_hdr->count < m_hdr->capacity ? m_hdr->count : m_hdr->capacity;
+}
+
+inline uint64_t
+sample_log_reader::get_lost() const
+{
+    return m_hdr->count - size();
+}
+
+inline sample_record
+sample_log_reader::get(size_t i) const
+{
+    // Once a ring has wrapped the oldest record sits right after the newest
+    size_t slot = i;
+    if (m_hdr->ring && m_hdr->count > m_hdr->capacity) {
+        slot = (m_hdr->count + i) % m_hdr->capacity;
+    }
+    const char* rec = m_records + slot * m_hdr->record_size;
+
+    sample_record r;
+    int32_t hdr[2];
+    memcpy(hdr, rec, sizeof(hdr));
+    memcpy(&r.timestamp_ns, rec + sizeof(hdr), sizeof(r.timestamp_ns));
+    r.input_sz = hdr[0];
+    r.round    = hdr[1];
+    r.counts   = reinterpret_cast<const int64_t*>(
+        rec + sample_log_format::record_header);
+    return r;
+}
+
+inline std::vector<long long>
+sample_log_reader::get_samples(int input_sz, size_t ev) const
+{
+    std::vector<long long> samples;
+    if (ev >= m_events.size()) {
+        return samples;
+    }
+    for (size_t i = 0; i < size(); ++i) {
+        const sample_record r = get(i);
+        if (r.input_sz == input_sz) {
+            samples.push_back(r.counts[ev]);
+        }
+    }
+    return samples;
+}
+}
+
+#endif  // _EXP_PERF_SAMPLE_LOG_H
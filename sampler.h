@@ -0,0 +1,266 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_SAMPLER_H
+#define _EXP_PERF_SAMPLER_H
+
+#include "event.h"
+
+#include <asm/unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// The sampling counterpart of counter: one event opened with a
+// sample_period, whose overflows the kernel records with
+// PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN into a ring buffer mapped into our
+// address space.
+//
+// Between start() and stop() the calling thread is sampled every period
+// counts of the event. stop() drains the ring, so the samples of the last
+// window are in get_samples() until the next start(). Only user space is
+// sampled, which perf_event_paranoid=2 allows.
+//
+// For example, every 100k cycles:
+//
+// sampler s(event::hw(PERF_COUNT_HW_CPU_CYCLES), 100000);
+// s.start();
+// run(N);
+// s.stop();
+// for (auto& x : s.get_samples()) ...
+//
+class sampler
+{
+  public:
+    struct sample {
+        uint64_t ip;
+        // The user space return addresses, innermost first and starting with
+        // ip, without the PERF_CONTEXT_* markers. Empty without callchains.
+        std::vector<uint64_t> callchain;
+    };
+
+    // e - the event to sample on, a pseudo event is EINVAL
+    // period - sample every period counts of e, in ns for the clocks
+    // callchain - also record the callchain of every sample
+    // pages - the ring buffer is this many pages, a power of two. A window
+    // with more samples than fit loses the oldest, see get_lost().
+    //
+    // Throws std::system_error if the event can't be opened or mapped.
+    sampler(const event& e,
+            uint64_t period,
+            bool callchain = true,
+            size_t pages   = 64);
+
+    ~sampler();
+
+    sampler(const sampler&) = delete;
+    sampler& operator=(const sampler&) = delete;
+
+    // Discard whatever is in the ring, and start sampling
+    void start();
+
+    // Stop sampling and read back the samples since start()
+    void stop();
+
+    // The samples of the last window
+    const std::vector<sample>& get_samples() const;
+
+    // Hand over the samples of the last window, leaving get_samples() empty
+    void take(std::vector<sample>& samples);
+
+    // How many samples the kernel dropped in the last window because the
+    // ring was full
+    uint64_t get_lost() const;
+
+    uint64_t get_period() const;
+
+  private:
+    // Parse the records between data_tail and data_head
+    void drain();
+
+    // Copy len bytes at offset off of the ring, which may wrap, into out
+    void copy(uint64_t off, void* out, size_t len) const;
+
+    const uint64_t m_period;
+    int m_fd;
+    perf_event_mmap_page* m_page;
+    const char* m_data;  // The ring, right after m_page
+    size_t m_data_size;
+    size_t m_map_size;
+    std::vector<sample> m_samples;
+    std::vector<char> m_buf;  // One record, unwrapped
+    uint64_t m_lost;
+};
+
+inline sampler::sampler(const event& e,
+                        uint64_t period,
+                        bool callchain,
+                        size_t pages)
+    : m_period(period)
+    , m_fd(-1)
+    , m_page(nullptr)
+    , m_data(nullptr)
+    , m_data_size(0)
+    , m_map_size(0)
+    , m_lost(0)
+{
+    if (e.is_timer() || e.is_alloc() || period == 0 || pages == 0 ||
+        (pages & (pages - 1)) != 0) {
+        throw std::system_error(EINVAL, std::system_category());
+    }
+    perf_event_attr pe;
+    memset(&pe, 0, sizeof(struct perf_event_attr));
+
+    pe.type           = e.type;
+    pe.size           = sizeof(struct perf_event_attr);
+    pe.config         = e.config;
+    pe.sample_period  = period;
+    pe.sample_type    = PERF_SAMPLE_IP;
+    pe.disabled       = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv     = 1;
+    if (callchain) {
+        pe.sample_type |= PERF_SAMPLE_CALLCHAIN;
+        pe.exclude_callchain_kernel = 1;
+    }
+
+    m_fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+    if (m_fd < 0) {
+        throw std::system_error(errno, std::system_category());
+    }
+    const size_t page_sz = sysconf(_SC_PAGESIZE);
+    m_data_size          = pages * page_sz;
+    m_map_size           = m_data_size + page_sz;
+
+    // Writable, so that we can move data_tail
+    void* p = ::mmap(
+        nullptr, m_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (p == MAP_FAILED) {
+        const int err = errno;
+        ::close(m_fd);
+        throw std::system_error(err, std::system_category());
+    }
+    m_page = static_cast<perf_event_mmap_page*>(p);
+    m_data = static_cast<const char*>(p) + page_sz;
+}
+
+inline sampler::~sampler()
+{
+    ::munmap(m_page, m_map_size);
+    ::close(m_fd);
+}
+
+inline void
+sampler::start()
+{
+    m_samples.clear();
+    m_lost = 0;
+    // Drop what an earlier window, or warm-up, left behind
+    __atomic_store_n(&m_page->data_tail,
+                     __atomic_load_n(&m_page->data_head, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+    if (ioctl(m_fd, PERF_EVENT_IOC_RESET, 0) < 0) {
+        throw std::system_error(errno, std::system_category());
+    }
+    if (ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+        throw std::system_error(errno, std::system_category());
+    }
+}
+
+inline void
+sampler::stop()
+{
+    if (ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0) < 0) {
+        throw std::system_error(errno, std::system_category());
+    }
+    drain();
+}
+
+inline const std::vector<sampler::sample>&
+sampler::get_samples() const
+{
+    return m_samples;
+}
+
+inline void
+sampler::take(std::vector<sample>& samples)
+{
+    samples.clear();
+    std::swap(samples, m_samples);
+}
+
+inline uint64_t
+sampler::get_lost() const
+{
+    return m_lost;
+}
+
+inline uint64_t
+sampler::get_period() const
+{
+    return m_period;
+}
+
+inline void
+sampler::copy(uint64_t off, void* out, size_t len) const
+{
+    const size_t at    = off & (m_data_size - 1);
+    const size_t first = std::min(len, m_data_size - at);
+    memcpy(out, m_data + at, first);
+    memcpy(static_cast<char*>(out) + first, m_data, len - first);
+}
+
+inline void
+sampler::drain()
+{
+    // The kernel writes up to data_head, we own everything before it until
+    // data_tail is moved past it
+    const uint64_t head = __atomic_load_n(&m_page->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail       = m_page->data_tail;
+    while (tail + sizeof(perf_event_header) <= head) {
+        perf_event_header h;
+        copy(tail, &h, sizeof(h));
+        if (h.size < sizeof(h) || tail + h.size > head) {
+            break;
+        }
+        m_buf.resize(h.size);
+        copy(tail, m_buf.data(), h.size);
+        const uint64_t* body =
+            reinterpret_cast<const uint64_t*>(m_buf.data() + sizeof(h));
+        const size_t words = (h.size - sizeof(h)) / sizeof(uint64_t);
+
+        if (h.type == PERF_RECORD_SAMPLE && words >= 1) {
+            // u64 ip; { u64 nr; u64 ips[nr]; } if PERF_SAMPLE_CALLCHAIN
+            sample s;
+            s.ip = body[0];
+            if (words >= 2) {
+                const size_t nr = std::min<size_t>(body[1], words - 2);
+                for (size_t i = 0; i < nr; ++i) {
+                    if (body[2 + i] < (uint64_t)PERF_CONTEXT_MAX) {
+                        s.callchain.push_back(body[2 + i]);
+                    }
+                }
+            }
+            m_samples.push_back(std::move(s));
+        } else if (h.type == PERF_RECORD_LOST && words >= 2) {
+            // u64 id; u64 lost;
+            m_lost += body[1];
+        }
+        tail += h.size;
+    }
+    __atomic_store_n(&m_page->data_tail, head, __ATOMIC_RELEASE);
+}
+}
+
+#endif  // _EXP_PERF_SAMPLER_H
@@ -0,0 +1,163 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_SCHEDULE_H
+#define _EXP_PERF_SCHEDULE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// Input size schedules that follow the cache hierarchy.
+//
+// Doubling steps over the capacity of each cache level in one go, which is
+// where the cost per element changes most, and spends as many sizes beyond
+// the last level cache, where nothing new happens. cache_schedule() samples
+// densely around each capacity and sparsely past the LLC:
+//
+// std::vector<int> sizes = cache_schedule(1024, 1 << 24, sizeof(int));
+// c.collect(sizes, start, stop, run, u);
+//
+struct cache_level {
+    int level;
+    long long size;  // In bytes
+};
+
+// The data and unified caches of cpu0, from
+// /sys/devices/system/cpu/cpu0/cache, in increasing size. Empty if sysfs has
+// no cache information, in a VM for example.
+std::vector<cache_level> cache_levels();
+
+// Input sizes from min_sz to max_sz: doubling below 4 times the last level
+// cache and quadrupling above, plus per_transition sizes spaced
+// geometrically from half to twice the capacity of each level, in elements
+// of bytes_per_element. Sorted, without sizes within 10% of each other, and
+// always starting at min_sz.
+std::vector<int> cache_schedule(int min_sz,
+                                int max_sz,
+                                int bytes_per_element,
+                                int per_transition = 4);
+
+// As above, for the given capacities
+std::vector<int> cache_schedule(int min_sz,
+                                int max_sz,
+                                int bytes_per_element,
+                                int per_transition,
+                                const std::vector<cache_level>& levels);
+
+inline std::vector<cache_level>
+cache_levels()
+{
+    std::vector<cache_level> levels;
+    const std::string dir = "/sys/devices/system/cpu/cpu0/cache/index";
+    for (int i = 0;; ++i) {
+        const std::string index = dir + std::to_string(i) + "/";
+        char type[32] = {0}, size[32] = {0};
+        int level = 0;
+
+        FILE* f = fopen((index + "level").c_str(), "r");
+        if (f == nullptr) {
+            break;
+        }
+        const bool ok = fscanf(f, "%d", &level) == 1;
+        fclose(f);
+        f = fopen((index + "type").c_str(), "r");
+        if (!ok || f == nullptr) {
+            break;
+        }
+        const bool is_instr = fscanf(f, "%31s", type) == 1 &&
+                              strcmp(type, "Instruction") == 0;
+        fclose(f);
+        f = fopen((index + "size").c_str(), "r");
+        if (f == nullptr) {
+            break;
+        }
+        const bool has_size = fscanf(f, "%31s", size) == 1;
+        fclose(f);
+        if (is_instr || !has_size) {
+            continue;
+        }
+
+        // "48K", "2048K", "32M"
+        char* end       = nullptr;
+        long long bytes = strtoll(size, &end, 10);
+        if (*end == 'K') {
+            bytes <<= 10;
+        } else if (*end == 'M') {
+            bytes <<= 20;
+        } else if (*end == 'G') {
+            bytes <<= 30;
+        }
+        if (bytes > 0) {
+            levels.push_back(cache_level{level, bytes});
+        }
+    }
+    std::sort(levels.begin(),
+              levels.end(),
+              [](const cache_level& x, const cache_level& y) {
+                  return x.size < y.size;
+              });
+    return levels;
+}
+
+inline std::vector<int>
+cache_schedule(int min_sz,
+               int max_sz,
+               int bytes_per_element,
+               int per_transition)
+{
+    return cache_schedule(
+        min_sz, max_sz, bytes_per_element, per_transition, cache_levels());
+}
+
+inline std::vector<int>
+cache_schedule(int min_sz,
+               int max_sz,
+               int bytes_per_element,
+               int per_transition,
+               const std::vector<cache_level>& levels)
+{
+    std::vector<double> xs;
+    if (min_sz < 1 || max_sz < min_sz || bytes_per_element < 1) {
+        return std::vector<int>();
+    }
+    const double bpe = bytes_per_element;
+    // Past 4 times the LLC everything comes from memory
+    const double flat =
+        levels.empty() ? INFINITY : 4 * levels.back().size / bpe;
+
+    for (double N = min_sz; N <= max_sz; N *= N < flat ? 2 : 4) {
+        xs.push_back(N);
+    }
+    for (const auto& l : levels) {
+        const double C = l.size / bpe;
+        for (int i = 0; i < per_transition; ++i) {
+            // From C / 2 to 2 C, both included
+            const double t =
+                per_transition > 1 ? (double)i / (per_transition - 1) : 0.5;
+            const double N = C * std::pow(2., 2 * t - 1);
+            if (N >= min_sz && N <= max_sz) {
+                xs.push_back(N);
+            }
+        }
+    }
+    std::sort(xs.begin(), xs.end());
+
+    std::vector<int> sizes;
+    for (double x : xs) {
+        const int N = (int)std::lround(x);
+        if (sizes.empty() || N > sizes.back() * 1.1) {
+            sizes.push_back(N);
+        }
+    }
+    return sizes;
+}
+}
+
+#endif  // _EXP_PERF_SCHEDULE_H
@@ -0,0 +1,353 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_SCOPE_H
+#define _EXP_PERF_SCOPE_H
+
+#include "counter.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// Always-on instrumentation of regions inside production code.
+//
+// EXP_PERF_SCOPE(name) counts the instructions and cycles from where it is
+// declared to the end of the enclosing block, and adds them to the region
+// name in a slot of the calling thread. Slots are cache line aligned and
+// only ever written by their thread, so threads never contend. The counts
+// are read with rdpmc, see counter::read_user(), so entering and leaving a
+// scope costs a few dozen cycles and no syscall.
+//
+// For example:
+//
+// void parse(const char* p)
+// {
+//     EXP_PERF_SCOPE("parse");
+//     ...
+// }
+//
+// scope_flusher f(1000, [](const std::vector<scopes::stats>& s) {
+//     for (auto& x : s) printf("%s %llu %lld\n", x.name.c_str(), ...);
+// });
+//
+// Each thread opens its own counter on its first scope, which stays enabled
+// for the life of the thread. Where rdpmc isn't allowed, or the event isn't
+// on the PMU at the time, the call is still counted but its counts are not;
+// compare calls with timed_calls.
+//
+class scopes
+{
+  public:
+    // Regions beyond this many throw E2BIG
+    static const int max_regions = 256;
+
+    // The totals of one region over every thread, live and exited
+    struct stats {
+        std::string name;
+        uint64_t calls;
+        uint64_t timed_calls;  // Calls whose counts could be read
+        long long instructions;
+        long long cycles;
+    };
+
+    // The id of the region called name, the same for the same name
+    static int region(const char* name);
+
+    // The totals of every region so far, in the order of region()
+    static std::vector<stats> snapshot();
+
+    // One region of one thread
+    struct alignas(64) slot {
+        uint64_t calls;
+        uint64_t timed_calls;
+        long long instructions;
+        long long cycles;
+    };
+
+    // The counter and slots of one thread
+    struct thread_state {
+        thread_state();
+        ~thread_state();
+
+        fixed_counter<2> counter;
+        int instr_idx;
+        int cycles_idx;
+        slot slots[max_regions];
+    };
+
+    // Those of the calling thread, created on first use
+    static thread_state& get_thread();
+
+  private:
+    struct registry {
+        std::mutex mtx;
+        std::vector<std::string> names;
+        std::vector<thread_state*> threads;
+        std::vector<slot> exited;  // What threads that are gone counted
+    };
+
+    static registry& get_registry();
+
+    // Frees what get_thread() allocated
+    struct thread_deleter {
+        void operator()(thread_state* t) const;
+    };
+};
+
+//
+// What EXP_PERF_SCOPE declares: counts from construction to destruction
+//
+class scope
+{
+  public:
+    explicit scope(int region);
+    ~scope();
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+  private:
+    scopes::thread_state& m_thread;
+    scopes::slot& m_slot;
+    long long m_instructions;
+    long long m_cycles;
+    bool m_instr_ok;
+    bool m_cycles_ok;
+};
+
+//
+// Calls f with scopes::snapshot() every interval_ms from a thread of its own,
+// and once more when destroyed
+//
+class scope_flusher
+{
+  public:
+    scope_flusher(int interval_ms,
+                  std::function<void(const std::vector<scopes::stats>&)> f);
+    ~scope_flusher();
+
+  private:
+    void loop();
+
+    const int m_interval_ms;
+    std::function<void(const std::vector<scopes::stats>&)> m_f;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    bool m_done;
+    std::thread m_thread;
+};
+
+inline scopes::registry&
+scopes::get_registry()
+{
+    // Leaked, so that threads exiting after main() still find it
+    static registry* r = new registry;
+    return *r;
+}
+
+inline int
+scopes::region(const char* name)
+{
+    registry& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    const auto it = std::find(r.names.begin(), r.names.end(), name);
+    if (it != r.names.end()) {
+        return (int)(it - r.names.begin());
+    }
+    if (r.names.size() == max_regions) {
+        throw std::system_error(E2BIG, std::system_category());
+    }
+    r.names.push_back(name);
+    r.exited.push_back(slot());
+    return (int)r.names.size() - 1;
+}
+
+inline scopes::thread_state::thread_state()
+    : counter({event::hw(PERF_COUNT_HW_INSTRUCTIONS),
+               event::hw(PERF_COUNT_HW_CPU_CYCLES)},
+              fixed_counter<2>::READ_RDPMC)
+    , instr_idx(counter.find(event::hw(PERF_COUNT_HW_INSTRUCTIONS)))
+    , cycles_idx(counter.find(event::hw(PERF_COUNT_HW_CPU_CYCLES)))
+    , slots()
+{
+    if (counter.get_counts_size() > 0) {
+        // Left running, scope only ever reads it
+        counter.start();
+    }
+    registry& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    r.threads.push_back(this);
+}
+
+inline scopes::thread_state::~thread_state()
+{
+    registry& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    for (size_t i = 0; i < r.exited.size(); ++i) {
+        r.exited[i].calls += slots[i].calls;
+        r.exited[i].timed_calls += slots[i].timed_calls;
+        r.exited[i].instructions += slots[i].instructions;
+        r.exited[i].cycles += slots[i].cycles;
+    }
+    r.threads.erase(std::find(r.threads.begin(), r.threads.end(), this));
+}
+
+inline void
+scopes::thread_deleter::operator()(thread_state* t) const
+{
+    t->~thread_state();
+    free(t);
+}
+
+inline scopes::thread_state&
+scopes::get_thread()
+{
+    // A plain pointer for the fast path, since a thread_local with a
+    // destructor goes through an initialization check on every access
+    static thread_local thread_state* t = nullptr;
+    if (t == nullptr) {
+        static thread_local std::unique_ptr<thread_state, thread_deleter> owner;
+        // new only aligns to alignof(max_align_t) before C++17
+        void* p      = nullptr;
+        const int rc =
+            posix_memalign(&p, alignof(thread_state), sizeof(thread_state));
+        if (rc != 0) {
+            throw std::system_error(ENOMEM, std::system_category());
+        }
+        try {
+            owner.reset(new (p) thread_state);
+        } catch (...) {
+            free(p);
+            throw;
+        }
+        t = owner.get();
+    }
+    return *t;
+}
+
+inline std::vector<scopes::stats>
+scopes::snapshot()
+{
+    registry& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    std::vector<stats> all;
+    for (size_t i = 0; i < r.names.size(); ++i) {
+        const slot& e = r.exited[i];
+        stats s = {
+            r.names[i], e.calls, e.timed_calls, e.instructions, e.cycles};
+        // The owner may be adding to its slot right now, each field is read
+        // atomically but they may be one call apart
+        for (const thread_state* t : r.threads) {
+            const slot& x = t->slots[i];
+            s.calls += __atomic_load_n(&x.calls, __ATOMIC_RELAXED);
+            s.timed_calls += __atomic_load_n(&x.timed_calls, __ATOMIC_RELAXED);
+            s.instructions +=
+                __atomic_load_n(&x.instructions, __ATOMIC_RELAXED);
+            s.cycles += __atomic_load_n(&x.cycles, __ATOMIC_RELAXED);
+        }
+        all.push_back(s);
+    }
+    return all;
+}
+
+inline scope::scope(int region)
+    : m_thread(scopes::get_thread())
+    , m_slot(m_thread.slots[region])
+    , m_instructions(0)
+    , m_cycles(0)
+{
+    m_instr_ok = m_thread.instr_idx >= 0 &&
+                 m_thread.counter.read_user(m_thread.instr_idx, m_instructions);
+    m_cycles_ok = m_thread.cycles_idx >= 0 &&
+                  m_thread.counter.read_user(m_thread.cycles_idx, m_cycles);
+}
+
+inline scope::~scope()
+{
+    long long instructions = 0, cycles = 0;
+    const bool instr_ok =
+        m_instr_ok &&
+        m_thread.counter.read_user(m_thread.instr_idx, instructions);
+    const bool cycles_ok =
+        m_cycles_ok && m_thread.counter.read_user(m_thread.cycles_idx, cycles);
+
+    // Only this thread writes the slot, so a load and a store will do, but
+    // atomic ones so that snapshot() never sees a torn value
+    scopes::slot& s = m_slot;
+    __atomic_store_n(&s.calls, s.calls + 1, __ATOMIC_RELAXED);
+    if (instr_ok || cycles_ok) {
+        __atomic_store_n(&s.timed_calls, s.timed_calls + 1, __ATOMIC_RELAXED);
+    }
+    if (instr_ok) {
+        __atomic_store_n(&s.instructions,
+                         s.instructions + (instructions - m_instructions),
+                         __ATOMIC_RELAXED);
+    }
+    if (cycles_ok) {
+        __atomic_store_n(
+            &s.cycles, s.cycles + (cycles - m_cycles), __ATOMIC_RELAXED);
+    }
+}
+
+inline scope_flusher::scope_flusher(
+    int interval_ms,
+    std::function<void(const std::vector<scopes::stats>&)> f)
+    : m_interval_ms(interval_ms)
+    , m_f(std::move(f))
+    , m_done(false)
+    , m_thread(&scope_flusher::loop, this)
+{
+}
+
+inline scope_flusher::~scope_flusher()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_done = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+    m_f(scopes::snapshot());
+}
+
+inline void
+scope_flusher::loop()
+{
+    std::unique_lock<std::mutex> lock(m_mtx);
+    while (!m_cv.wait_for(lock,
+                          std::chrono::milliseconds(m_interval_ms),
+                          [this] { return m_done; })) {
+        lock.unlock();
+        m_f(scopes::snapshot());
+        lock.lock();
+    }
+}
+}
+
+#define EXP_PERF_SCOPE_CAT2(a, b) a##b
+#define EXP_PERF_SCOPE_CAT(a, b) EXP_PERF_SCOPE_CAT2(a, b)
+
+// Count from here to the end of the enclosing block as region name. The
+// region is looked up once, by a function local static.
+#define EXP_PERF_SCOPE(name)                                                  \
+    static const int EXP_PERF_SCOPE_CAT(exp_perf_region_, __LINE__) =        \
+        ::exp_perf::scopes::region(name);                                    \
+    ::exp_perf::scope EXP_PERF_SCOPE_CAT(exp_perf_scope_, __LINE__)(         \
+        EXP_PERF_SCOPE_CAT(exp_perf_region_, __LINE__))
+
+#endif  // _EXP_PERF_SCOPE_H
@@ -0,0 +1,115 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_TIMER_H
+#define _EXP_PERF_TIMER_H
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace exp_perf
+{
+//
+// Timing backends for when no perf event can be opened at all, for example
+// in containers with perf_event_paranoid=3. collector uses them through the
+// pseudo events event::tsc() and event::clock(), see collector::get_backend().
+//
+// Each backend has the same static interface:
+//
+//   available() - whether it can be used on this machine
+//   begin()     - read right before the window is entered
+//   end()       - read right after it is left
+//
+// and end() - begin() is the count of the window.
+//
+
+// The time stamp counter, in reference cycles. Only used when the TSC is
+// invariant, i.e. ticks at a constant rate across frequency changes and idle
+// states, and rdtscp exists. The reads are fenced by lfence so that the
+// window contains exactly the instructions between them.
+struct tsc_timer {
+    static bool available();
+    static long long begin();
+    static long long end();
+};
+
+// clock_gettime(CLOCK_MONOTONIC_RAW) in ns, which is not slewed by NTP. A
+// vDSO call, so no syscall, but much coarser than the TSC.
+struct clock_timer {
+    static bool available();
+    static long long begin();
+    static long long end();
+};
+
+inline bool
+tsc_timer::available()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned a, b, c, d;
+    if (__get_cpuid(0x80000000, &a, &b, &c, &d) == 0 || a < 0x80000007) {
+        return false;
+    }
+    __get_cpuid(0x80000001, &a, &b, &c, &d);
+    const bool rdtscp = d & (1u << 27);
+    __get_cpuid(0x80000007, &a, &b, &c, &d);
+    const bool invariant = d & (1u << 8);
+    return rdtscp && invariant;
+#else
+    return false;
+#endif
+}
+
+inline long long
+tsc_timer::begin()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned lo, hi;
+    // Don't start reading before everything earlier has finished, and don't
+    // start the window before the read has
+    asm volatile("lfence\n\trdtsc\n\tlfence" : "=a"(lo), "=d"(hi)::"memory");
+    return (long long)(((unsigned long long)hi << 32) | lo);
+#else
+    return 0;
+#endif
+}
+
+inline long long
+tsc_timer::end()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned lo, hi, aux;
+    // rdtscp waits for the window to finish, the lfence keeps whatever
+    // follows from starting before the read
+    asm volatile("rdtscp\n\tlfence"
+                 : "=a"(lo), "=d"(hi), "=c"(aux)::"memory");
+    return (long long)(((unsigned long long)hi << 32) | lo);
+#else
+    return 0;
+#endif
+}
+
+inline bool
+clock_timer::available()
+{
+    timespec ts;
+    return clock_gettime(CLOCK_MONOTONIC_RAW, &ts) == 0;
+}
+
+inline long long
+clock_timer::begin()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+inline long long
+clock_timer::end()
+{
+    return begin();
+}
+}
+
+#endif  // _EXP_PERF_TIMER_H
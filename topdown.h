@@ -0,0 +1,273 @@
+// Copyright (C) 2016 by telfer - MIT License. See LICENSE.txt
+
+#ifndef _EXP_PERF_TOPDOWN_H
+#define _EXP_PERF_TOPDOWN_H
+
+#include "event.h"
+
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace exp_perf
+{
+//
+// Level 1 of the top-down method: where the issue slots of the pipeline go.
+//
+//   retiring        - slots that retired a uop, useful work
+//   bad_speculation - slots spent on uops that were thrown away
+//   frontend_bound  - slots the frontend delivered no uop for
+//   backend_bound   - slots the backend couldn't accept a uop for
+//
+// The events are raw PMU codes, two groups per vendor. Each fraction is
+// computed from events of a single group, cycles included, so when the
+// kernel multiplexes the groups both sides of a ratio are scaled alike and
+// the ratio stays exact.
+//
+// For example:
+//
+// std::vector<event> evts = topdown::events();
+// evts.push_back(event::hw(PERF_COUNT_HW_INSTRUCTIONS));
+// collector c(0.05, 0.01, 10, 1000, 20, 50, evts,
+//             {event::hw(PERF_COUNT_HW_INSTRUCTIONS)});
+// c.set_tracking(collector::TRACK_ALL);
+// c.collect(N, runs, start, stop, run, [&](int N, ...) {
+//     topdown::breakdown b;
+//     if (c.get_topdown(b)) ...
+// });
+//
+class topdown
+{
+  public:
+    enum {
+        VENDOR_UNKNOWN = 0,
+        VENDOR_INTEL   = 1,
+        VENDOR_AMD     = 2
+    };
+
+    // The four fractions add up to about 1. On AMD backend_bound is measured
+    // rather than the remainder, so SMT contention makes up the rest.
+    struct breakdown {
+        double retiring;
+        double bad_speculation;
+        double frontend_bound;
+        double backend_bound;
+        double slots;  // Issue slots, width * cycles
+    };
+
+    // The vendor of the CPU we run on
+    static int vendor();
+
+    // The preset of this CPU, or empty if it has none. The two groups are
+    // first_group and first_group + 1, keep them apart from other events.
+    static std::vector<event> events(int first_group = 1);
+
+    // Intel cores from Sandy Bridge on, 4 slots per cycle:
+    //   first_group:     cycles, UOPS_ISSUED.ANY, UOPS_RETIRED.RETIRE_SLOTS,
+    //                    INT_MISC.RECOVERY_CYCLES
+    //   first_group + 1: cycles, IDQ_UOPS_NOT_DELIVERED.CORE
+    static std::vector<event> intel_events(int first_group = 1);
+
+    // AMD Zen 4 and later, 6 slots per cycle:
+    //   first_group:     cycles, de_src_op_disp.all, ex_ret_ops
+    //   first_group + 1: cycles, de_no_dispatch_per_slot.no_ops_from_frontend,
+    //                    de_no_dispatch_per_slot.backend_stalls
+    static std::vector<event> amd_events(int first_group = 1);
+
+    // The breakdown from t[i], the count of events[i] over the same
+    // windows. width overrides the slots per cycle of the preset, for cores
+    // that issue wider. Returns false unless every event of a preset is
+    // there with a non zero cycle count.
+    static bool compute(const std::vector<event>& events,
+                        const std::vector<double>& t,
+                        breakdown& b,
+                        int width = 0);
+
+  private:
+    // Raw codes, see the event lists above. AMD puts bits 11:8 of the event
+    // select in bits 35:32.
+    static const uint64_t INTEL_UOPS_ISSUED_ANY        = 0x010e;
+    static const uint64_t INTEL_UOPS_RETIRED_SLOTS     = 0x02c2;
+    static const uint64_t INTEL_RECOVERY_CYCLES        = 0x010d;
+    static const uint64_t INTEL_IDQ_UOPS_NOT_DELIVERED = 0x019c;
+    static const uint64_t AMD_OPS_DISPATCHED           = 0x07aa;
+    static const uint64_t AMD_OPS_RETIRED              = 0x00c1;
+    static const uint64_t AMD_NO_OPS_FROM_FRONTEND     = 0x1000001a0ULL;
+    static const uint64_t AMD_BACKEND_STALLS           = 0x100001ea0ULL;
+
+    // The index of the raw event config, or -1. With group >= 0 it must be
+    // in that group.
+    static int find(const std::vector<event>& events,
+                    uint32_t type,
+                    uint64_t config,
+                    int group = -1);
+
+    // The total of the cycles in group g, or 0
+    static double cycles(const std::vector<event>& events,
+                         const std::vector<double>& totals,
+                         int g);
+};
+
+inline int
+topdown::vendor()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned a, b, c, d;
+    if (__get_cpuid(0, &a, &b, &c, &d) == 0) {
+        return VENDOR_UNKNOWN;
+    }
+    char id[13];
+    memcpy(id, &b, 4);
+    memcpy(id + 4, &d, 4);
+    memcpy(id + 8, &c, 4);
+    id[12] = 0;
+    if (strcmp(id, "GenuineIntel") == 0) {
+        return VENDOR_INTEL;
+    }
+    if (strcmp(id, "AuthenticAMD") != 0) {
+        return VENDOR_UNKNOWN;
+    }
+    // Zen 4 is family 0x19 models 0x10-0x1f, 0x60-0x7f and 0xa0-0xaf, the
+    // other 0x19 models are Zen 3, which doesn't have the events
+    __get_cpuid(1, &a, &b, &c, &d);
+    const unsigned family = ((a >> 8) & 0xf) + ((a >> 20) & 0xff);
+    const unsigned model  = ((a >> 4) & 0xf) | ((a >> 12) & 0xf0);
+    const bool zen4 =
+        family == 0x19 && ((model >= 0x10 && model <= 0x1f) ||
+                           (model >= 0x60 && model <= 0x7f) ||
+                           (model >= 0xa0 && model <= 0xaf));
+    return family > 0x19 || zen4 ? VENDOR_AMD : VENDOR_UNKNOWN;
+#else
+    return VENDOR_UNKNOWN;
+#endif
+}
+
+inline std::vector<event>
+topdown::events(int first_group)
+{
+    switch (vendor()) {
+    case VENDOR_INTEL:
+        return intel_events(first_group);
+    case VENDOR_AMD:
+        return amd_events(first_group);
+    default:
+        return std::vector<event>();
+    }
+}
+
+inline std::vector<event>
+topdown::intel_events(int g)
+{
+    const event cycles = event::hw(PERF_COUNT_HW_CPU_CYCLES);
+    return {cycles.in_group(g),
+            event::raw(INTEL_UOPS_ISSUED_ANY).in_group(g),
+            event::raw(INTEL_UOPS_RETIRED_SLOTS).in_group(g),
+            event::raw(INTEL_RECOVERY_CYCLES).in_group(g),
+            cycles.in_group(g + 1),
+            event::raw(INTEL_IDQ_UOPS_NOT_DELIVERED).in_group(g + 1)};
+}
+
+inline std::vector<event>
+topdown::amd_events(int g)
+{
+    const event cycles = event::hw(PERF_COUNT_HW_CPU_CYCLES);
+    return {cycles.in_group(g),
+            event::raw(AMD_OPS_DISPATCHED).in_group(g),
+            event::raw(AMD_OPS_RETIRED).in_group(g),
+            cycles.in_group(g + 1),
+            event::raw(AMD_NO_OPS_FROM_FRONTEND).in_group(g + 1),
+            event::raw(AMD_BACKEND_STALLS).in_group(g + 1)};
+}
+
+inline int
+topdown::find(const std::vector<event>& events,
+              uint32_t type,
+              uint64_t config,
+              int group)
+{
+    for (size_t i = 0; i < events.size(); ++i) {
+        const event& e = events[i];
+        if (e.type == type && e.config == config &&
+            (group < 0 || e.group == group)) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+inline double
+topdown::cycles(const std::vector<event>& events,
+                const std::vector<double>& totals,
+                int g)
+{
+    const int i =
+        find(events, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, g);
+    return i >= 0 && (size_t)i < totals.size() ? totals[i] : 0;
+}
+
+inline bool
+topdown::compute(const std::vector<event>& events,
+                 const std::vector<double>& t,
+                 breakdown& b,
+                 int width)
+{
+    if (t.size() < events.size()) {
+        return false;
+    }
+
+    const int issued = find(events, PERF_TYPE_RAW, INTEL_UOPS_ISSUED_ANY);
+    const int idq = find(events, PERF_TYPE_RAW, INTEL_IDQ_UOPS_NOT_DELIVERED);
+    if (issued >= 0 && idq >= 0) {
+        const int g0 = events[issued].group;
+        const int g1 = events[idq].group;
+        const int retired =
+            find(events, PERF_TYPE_RAW, INTEL_UOPS_RETIRED_SLOTS, g0);
+        const int recovery =
+            find(events, PERF_TYPE_RAW, INTEL_RECOVERY_CYCLES, g0);
+        const int w     = width > 0 ? width : 4;
+        const double s0 = w * cycles(events, t, g0);
+        const double s1 = w * cycles(events, t, g1);
+        if (retired < 0 || recovery < 0 || s0 <= 0 || s1 <= 0) {
+            return false;
+        }
+        b.slots    = s0;
+        b.retiring = t[retired] / s0;
+        // Issued but not retired, plus the slots lost while recovering
+        b.bad_speculation = (t[issued] - t[retired] + w * t[recovery]) / s0;
+        b.frontend_bound  = t[idq] / s1;
+        b.backend_bound =
+            1 - b.retiring - b.bad_speculation - b.frontend_bound;
+        return true;
+    }
+
+    const int dispatched = find(events, PERF_TYPE_RAW, AMD_OPS_DISPATCHED);
+    const int frontend = find(events, PERF_TYPE_RAW, AMD_NO_OPS_FROM_FRONTEND);
+    if (dispatched >= 0 && frontend >= 0) {
+        const int g0      = events[dispatched].group;
+        const int g1      = events[frontend].group;
+        const int retired = find(events, PERF_TYPE_RAW, AMD_OPS_RETIRED, g0);
+        const int backend = find(events, PERF_TYPE_RAW, AMD_BACKEND_STALLS, g1);
+        const int w       = width > 0 ? width : 6;
+        const double s0   = w * cycles(events, t, g0);
+        const double s1   = w * cycles(events, t, g1);
+        if (retired < 0 || backend < 0 || s0 <= 0 || s1 <= 0) {
+            return false;
+        }
+        b.slots           = s0;
+        b.retiring        = t[retired] / s0;
+        b.bad_speculation = (t[dispatched] - t[retired]) / s0;
+        b.frontend_bound  = t[frontend] / s1;
+        b.backend_bound   = t[backend] / s1;
+        return true;
+    }
+    return false;
+}
+}
+
+#endif  // _EXP_PERF_TOPDOWN_H